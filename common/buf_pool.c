@@ -0,0 +1,121 @@
+/**
+ * @file: buf_pool.c
+ * @brief: size-classed pool of receive buffers
+ */
+
+#include <stdlib.h>
+#include "buf_pool.h"
+
+/**
+ * @return: index of the smallest class holding size bytes, or BUF_CLASSES
+ *          if size is larger than every class
+ */
+static int buf_class(size_t size)
+{
+    int c = 0;
+
+    while (c < BUF_CLASSES && ((size_t)BUF_CLASS_MIN << c) < size) {
+        c++;
+    }
+    return c;
+}
+
+void buf_pool_init(BUF_POOL *pool)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    for (int c = 0; c < BUF_CLASSES; c++) {
+        pool->count[c] = 0;
+    }
+    pool->idle = 0;
+}
+
+void buf_pool_destroy(BUF_POOL *pool)
+{
+    for (int c = 0; c < BUF_CLASSES; c++) {
+        for (int i = 0; i < pool->count[c]; i++) {
+            free(pool->bufs[c][i]);
+        }
+        pool->count[c] = 0;
+    }
+    pool->idle = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/**
+ * @brief: size buf_pool_get() hands out for a request of size bytes
+ * @return: the size of the smallest class holding size, or size itself
+ *          if it is larger than every class
+ */
+size_t buf_class_size(size_t size)
+{
+    int c = buf_class(size);
+
+    return c < BUF_CLASSES ? (size_t)BUF_CLASS_MIN << c : size;
+}
+
+/**
+ * @brief: take a buffer of at least size bytes, an idle one of the right
+ *         class if there is one
+ * @param: p_cap size_t* receives the real capacity of the buffer
+ * @return: NULL if out of memory
+ */
+char *buf_pool_get(BUF_POOL *pool, size_t size, size_t *p_cap)
+{
+    int c = buf_class(size);
+    char *buf = NULL;
+
+    if (c < BUF_CLASSES) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->count[c] > 0) {
+            buf = pool->bufs[c][--pool->count[c]];
+            pool->idle -= (size_t)BUF_CLASS_MIN << c;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    *p_cap = buf_class_size(size);
+    return buf != NULL ? buf : malloc(*p_cap);
+}
+
+/**
+ * @brief: return a buffer of capacity cap to the pool. It is freed if its
+ *         class already has BUF_CLASS_KEEP idle buffers, if keeping it
+ *         would take the pool over BUF_IDLE_MAX idle bytes or if cap is not
+ *         a class size.
+ */
+void buf_pool_put(BUF_POOL *pool, char *buf, size_t cap)
+{
+    int c = buf_class(cap);
+
+    if (buf == NULL) {
+        return;
+    }
+    if (c < BUF_CLASSES && ((size_t)BUF_CLASS_MIN << c) == cap) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->count[c] < BUF_CLASS_KEEP && pool->idle + cap <= BUF_IDLE_MAX) {
+            pool->bufs[c][pool->count[c]++] = buf;
+            pool->idle += cap;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(buf);
+}
+
+/**
+ * @brief: enlarge buf, of capacity *p_cap, to hold at least need bytes.
+ *         The capacity at least doubles so a response of unknown length
+ *         is copied O(log n) times, and stays a class size so the buffer
+ *         can still go back to a pool.
+ * @return: the new buffer, or NULL if out of memory, in which case buf is
+ *          left as it was
+ */
+char *buf_grow(char *buf, size_t need, size_t *p_cap)
+{
+    size_t cap = buf_class_size(need > 2 * *p_cap ? need : 2 * *p_cap);
+    char *q = realloc(buf, cap);
+
+    if (q != NULL) {
+        *p_cap = cap;
+    }
+    return q;
+}
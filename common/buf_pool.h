@@ -0,0 +1,36 @@
+/**
+ * @file: buf_pool.h
+ * @brief: idle receive buffers kept for reuse, sorted into power of two
+ *         size classes. A response whose Content-Length is known gets a
+ *         buffer of the smallest class that holds it, so a 10K fragment
+ *         takes 16K rather than a fixed 1M; one of unknown length starts
+ *         small and doubles, see buf_grow(). The idle buffers of all
+ *         classes together hold at most BUF_IDLE_MAX bytes.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* DEFINES */
+#define BUF_CLASS_MIN  4096    /* smallest size class in bytes            */
+#define BUF_CLASSES    16      /* classes BUF_CLASS_MIN to 128M, doubling */
+#define BUF_CLASS_KEEP 16      /* idle buffers kept per class             */
+#define BUF_IDLE_MAX   (4 << 20) /* idle bytes kept over all classes      */
+
+/* TYPEDEFS */
+typedef struct buf_pool {
+    pthread_mutex_t lock;
+    int count[BUF_CLASSES];                   /* idle buffers per class */
+    size_t idle;                              /* bytes in idle buffers  */
+    char *bufs[BUF_CLASSES][BUF_CLASS_KEEP];  /* the idle buffers */
+} BUF_POOL;
+
+/* FUNCTION PROTOTYPES */
+void buf_pool_init(BUF_POOL *pool);
+void buf_pool_destroy(BUF_POOL *pool);
+size_t buf_class_size(size_t size);
+char *buf_pool_get(BUF_POOL *pool, size_t size, size_t *p_cap);
+void buf_pool_put(BUF_POOL *pool, char *buf, size_t cap);
+char *buf_grow(char *buf, size_t need, size_t *p_cap);
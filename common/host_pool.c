@@ -0,0 +1,463 @@
+/**
+ * @file: host_pool.c
+ * @brief: latency aware selection of the image server for each request
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "host_pool.h"
+
+/**
+ * @brief: initialize a pool from a comma separated list of servers. Each
+ *         entry is either host[:port], in which case http:// and
+ *         default_port are filled in as needed, or a full base URL.
+ * @param: p HOST_POOL* pool to initialize
+ * @param: list const char* e.g. "ece252-1.uwaterloo.ca,localhost:8080", or
+ *         NULL for a pool that starts empty, see host_acquire_url()
+ * @param: default_port int port used when an entry has none
+ * @param: pshared int non-zero if p lives in memory shared between processes
+ * @return: 0 on success; non-zero if the list is empty or malformed
+ */
+int host_pool_init(HOST_POOL *p, const char *list, int default_port, int pshared)
+{
+    pthread_mutexattr_t attr;
+    char *copy = NULL;
+    char *save = NULL;
+    char *tok = NULL;
+
+    if (p == NULL) {
+        return 1;
+    }
+
+    memset(p, 0, sizeof(HOST_POOL));
+    if (list == NULL) {
+        goto init_lock;
+    }
+    copy = strdup(list);
+    if (copy == NULL) {
+        return 2;
+    }
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        HOST *host = &p->hosts[p->num_hosts];
+        const char *scheme = strstr(tok, "://") ? "" : "http://";
+        const char *hostpart = strstr(tok, "://") ? strstr(tok, "://") + 3 : tok;
+        int n = 0;
+
+        if (*tok == '\0') {
+            continue;
+        }
+        if (p->num_hosts == MAX_HOSTS) {
+            fprintf(stderr, "host_pool_init: more than %d hosts\n", MAX_HOSTS);
+            free(copy);
+            return 3;
+        }
+        if (strchr(hostpart, ':') != NULL) {
+            n = snprintf(host->base_url, HOST_URL_LEN, "%s%s", scheme, tok);
+        } else {
+            n = snprintf(host->base_url, HOST_URL_LEN, "%s%s:%d", scheme, tok, default_port);
+        }
+        if (n >= HOST_URL_LEN) {
+            fprintf(stderr, "host_pool_init: host name too long: %s\n", tok);
+            free(copy);
+            return 3;
+        }
+        /* strip a trailing '/' so that paths can be appended as is */
+        if (host->base_url[n - 1] == '/') {
+            host->base_url[n - 1] = '\0';
+        }
+        host->retry_budget = RETRY_BUDGET;
+        p->num_hosts++;
+    }
+    free(copy);
+
+    if (p->num_hosts == 0) {
+        return 1;
+    }
+
+init_lock:
+    pthread_mutexattr_init(&attr);
+    if (pshared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&p->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+void host_pool_destroy(HOST_POOL *p)
+{
+    pthread_mutex_destroy(&p->lock);
+}
+
+/**
+ * @brief: choose the host for a new request and count it as in flight.
+ *         The expected wait on a host is its average latency times the
+ *         requests it is already serving plus this one. A host that has
+ *         not answered yet is assumed to be as fast as the best known one,
+ *         so every server gets tried early.
+ * @param: exclude int index of a host not to use, -1 for none. Ignored if
+ *         it is the only host.
+ * @return: index of the chosen host, to be passed to host_release()
+ */
+static int acquire(HOST_POOL *p, int exclude)
+{
+    double best_ewma = 0;
+    double best_score = 0;
+    int best = -1;
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->num_hosts; i++) {
+        if (p->hosts[i].ewma > 0 && (best_ewma == 0 || p->hosts[i].ewma < best_ewma)) {
+            best_ewma = p->hosts[i].ewma;
+        }
+    }
+    if (best_ewma == 0) {
+        best_ewma = 1.0;   /* nothing measured yet, only load counts */
+    }
+
+    for (int i = 0; i < p->num_hosts; i++) {
+        HOST *host = &p->hosts[i];
+        double est = host->ewma > 0 ? host->ewma : best_ewma;
+        double score = (host->in_flight + 1) * est;
+
+        if (i == exclude && p->num_hosts > 1) {
+            continue;
+        }
+        /* a host out of retry budget only gets requests if all others are */
+        if (best >= 0 && (host->retry_budget < 1) != (p->hosts[best].retry_budget < 1)) {
+            if (host->retry_budget < 1) {
+                continue;
+            }
+            best = -1;
+        }
+        if (best < 0 || score < best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    p->hosts[best].in_flight++;
+    p->hosts[best].requests++;
+    if (exclude >= 0) {
+        p->hosts[best].hedges++;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return best;
+}
+
+int host_acquire(HOST_POOL *p)
+{
+    return acquire(p, -1);
+}
+
+/**
+ * @brief: like host_acquire() but for a hedge of a request that went to
+ *         host exclude, so it prefers any other host
+ */
+int host_acquire_other(HOST_POOL *p, int exclude)
+{
+    return acquire(p, exclude);
+}
+
+/**
+ * @brief: like host_acquire() for a request to url, which only the host
+ *         that serves it can answer. A host met for the first time is
+ *         added to the pool.
+ * @return: index of the host, to be passed to host_release(); -1 if url
+ *          has no host or the pool is full, in which case the request is
+ *          not tracked and gets the default timeout
+ */
+int host_acquire_url(HOST_POOL *p, const char *url)
+{
+    const char *sep = strstr(url, "://");
+    char origin[HOST_URL_LEN];
+    size_t len;
+    int h = -1;
+
+    if (sep == NULL) {
+        return -1;
+    }
+    /* scheme://host:port, the part of url a connection is made to */
+    len = sep + 3 - url + strcspn(sep + 3, "/?#");
+    if (len >= HOST_URL_LEN) {
+        return -1;
+    }
+    memcpy(origin, url, len);
+    origin[len] = '\0';
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->num_hosts && h < 0; i++) {
+        if (strcmp(p->hosts[i].base_url, origin) == 0) {
+            h = i;
+        }
+    }
+    if (h < 0 && p->num_hosts < MAX_HOSTS) {
+        h = p->num_hosts++;
+        memcpy(p->hosts[h].base_url, origin, len + 1);
+        p->hosts[h].retry_budget = RETRY_BUDGET;
+    }
+    if (h >= 0) {
+        p->hosts[h].in_flight++;
+        p->hosts[h].requests++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return h;
+}
+
+/**
+ * @brief: latency quantile of host h from its histogram, e.g. q = 0.9
+ *         for the time 90% of the recent requests finished within. A host
+ *         with too few samples of its own is judged by those of the whole
+ *         pool, so a server that has never answered can still be hedged
+ *         and timed out.
+ * @return: seconds, or 0 if there are not enough samples yet
+ */
+double host_quantile(HOST_POOL *p, int h, double q)
+{
+    int hist[HIST_BUCKETS] = { 0 };
+    int count = 0;
+    double bound = 0;
+    int sum = 0;
+    int need = 0;
+
+    if (h < 0) {
+        return 0;   /* a request host_acquire_url() could not track */
+    }
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->num_hosts; i++) {
+        if (i != h && p->hosts[h].hist_count >= HIST_MIN) {
+            continue;
+        }
+        for (int k = 0; k < HIST_BUCKETS; k++) {
+            hist[k] += p->hosts[i].hist[k];
+        }
+        count += p->hosts[i].hist_count;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (count >= HIST_MIN) {
+        need = (int)(q * count + 0.999);
+        bound = HIST_BASE;
+        for (int k = 0; k < HIST_BUCKETS; k++) {
+            sum += hist[k];
+            if (sum >= need) {
+                break;
+            }
+            bound *= HIST_GROWTH;
+        }
+    }
+    return bound;
+}
+
+/**
+ * @brief: add one latency sample to the histogram of host, halving all
+ *         counts once there are HIST_MAX of them
+ */
+static void hist_add(HOST *host, double seconds)
+{
+    double bound = HIST_BASE;
+    int k = 0;
+
+    while (k < HIST_BUCKETS - 1 && seconds > bound) {
+        bound *= HIST_GROWTH;
+        k++;
+    }
+    host->hist[k]++;
+    host->hist_count++;
+
+    if (host->hist_count >= HIST_MAX) {
+        host->hist_count = 0;
+        for (k = 0; k < HIST_BUCKETS; k++) {
+            host->hist[k] /= 2;
+            host->hist_count += host->hist[k];
+        }
+    }
+}
+
+/**
+ * @brief: record the outcome of a request sent to host h
+ * @param: seconds double time from sending the request to the last byte
+ * @param: ok int zero if the request failed, which counts as at least
+ *         twice the current average so traffic moves away from the host,
+ *         and takes one unit of its retry budget
+ */
+void host_release(HOST_POOL *p, int h, double seconds, int ok)
+{
+    HOST *host = NULL;
+
+    if (h < 0 || h >= p->num_hosts) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    host = &p->hosts[h];
+    host->in_flight--;
+    if (!ok && seconds < 2 * host->ewma) {
+        seconds = 2 * host->ewma < TIMEOUT_MAX ? 2 * host->ewma : TIMEOUT_MAX;
+    }
+    if (!ok) {
+        host->retry_budget -= 1;
+        host->failures++;
+    } else if (host->retry_budget + RETRY_REFUND <= RETRY_BUDGET) {
+        host->retry_budget += RETRY_REFUND;
+    } else {
+        host->retry_budget = RETRY_BUDGET;
+    }
+    if (host->ewma == 0) {
+        host->ewma = seconds;
+    } else {
+        host->ewma += EWMA_WEIGHT * (seconds - host->ewma);
+    }
+    if (ok) {
+        hist_add(host, seconds);   /* a failure says little about latency */
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * @brief: forget a request sent to host h that was abandoned before it
+ *         completed, without counting its time as a latency sample
+ */
+void host_cancel(HOST_POOL *p, int h)
+{
+    if (h < 0 || h >= p->num_hosts) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->hosts[h].in_flight--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * @brief: how long a request to host h may take before it is given up.
+ *         Several times the recent p99 of the host, so that a hung
+ *         connection is dropped long before it stalls the job, yet a
+ *         merely slow answer still gets through.
+ * @return: seconds, between TIMEOUT_MIN and TIMEOUT_MAX; TIMEOUT_MAX for
+ *          h < 0
+ */
+double host_timeout(HOST_POOL *p, int h)
+{
+    double timeout = TIMEOUT_MULT * host_quantile(p, h, 0.99);
+
+    if (timeout <= 0 || timeout > TIMEOUT_MAX) {
+        return TIMEOUT_MAX;   /* no history yet, or a very slow host */
+    }
+    return timeout < TIMEOUT_MIN ? TIMEOUT_MIN : timeout;
+}
+
+/**
+ * @brief: check if every host has used up its retry budget. Each failure
+ *         takes one unit of budget and each success gives RETRY_REFUND
+ *         back, so a host that keeps failing runs dry while one that
+ *         fails now and then never does.
+ * @return: non-zero if there is no host left worth retrying
+ */
+int host_pool_exhausted(HOST_POOL *p)
+{
+    int exhausted = 1;
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->num_hosts; i++) {
+        if (p->hosts[i].retry_budget >= 1) {
+            exhausted = 0;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return exhausted;
+}
+
+/**
+ * @brief: check if a failed request to host h is worth sending again, as
+ *         far as the host goes: it has retry budget left
+ * @return: non-zero if it is; always for h < 0
+ */
+int host_retryable(HOST_POOL *p, int h)
+{
+    int ok = 1;
+
+    if (h < 0 || h >= p->num_hosts) {
+        return ok;
+    }
+    pthread_mutex_lock(&p->lock);
+    ok = p->hosts[h].retry_budget >= 1;
+    pthread_mutex_unlock(&p->lock);
+    return ok;
+}
+
+/**
+ * @brief: check if a failed transfer is worth trying again: the server was
+ *         slow or the connection broke, as opposed to e.g. a bad URL
+ */
+int host_transient(CURLcode res)
+{
+    return res == CURLE_OPERATION_TIMEDOUT || res == CURLE_COULDNT_CONNECT ||
+           res == CURLE_SEND_ERROR || res == CURLE_RECV_ERROR ||
+           res == CURLE_GOT_NOTHING || res == CURLE_PARTIAL_FILE;
+}
+
+/**
+ * @brief: give every host its full retry budget back, for a long running
+ *         process starting on new work after the servers were down
+ */
+void host_pool_refill(HOST_POOL *p)
+{
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->num_hosts; i++) {
+        p->hosts[i].retry_budget = RETRY_BUDGET;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * @brief: time to wait before retry number attempt (1 for the first)
+ *         after a failure. Exponential with full jitter: uniform between 0
+ *         and BACKOFF_BASE * 2^(attempt - 1), capped at BACKOFF_MAX, so
+ *         that threads and processes that failed together do not all come
+ *         back at the same moment.
+ * @return: seconds
+ */
+double host_backoff(int attempt)
+{
+    static __thread unsigned int seed = 0;
+    double cap = BACKOFF_BASE;
+
+    if (seed == 0) {
+        seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16) ^
+               (unsigned int)(unsigned long)&cap;
+    }
+    for (int i = 1; i < attempt && cap < BACKOFF_MAX; i++) {
+        cap *= 2;
+    }
+    if (cap > BACKOFF_MAX) {
+        cap = BACKOFF_MAX;
+    }
+    return cap * rand_r(&seed) / RAND_MAX;
+}
+
+/**
+ * @return: base URL of host h, e.g. "http://ece252-1.uwaterloo.ca:2520"
+ */
+const char *host_url(HOST_POOL *p, int h)
+{
+    return p->hosts[h].base_url;
+}
+
+/**
+ * @brief: print the request count and average latency of every host
+ */
+void host_pool_report(HOST_POOL *p, FILE *fp)
+{
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->num_hosts; i++) {
+        fprintf(fp, "%s: %ld requests (%ld hedges, %ld failed), %.3f ms average\n",
+                p->hosts[i].base_url, p->hosts[i].requests, p->hosts[i].hedges,
+                p->hosts[i].failures, p->hosts[i].ewma * 1000);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file: host_pool.h
+ * @brief: pick which image server a request goes to. Every host keeps a
+ *         count of requests in flight and a moving average of its response
+ *         time; a request goes to the host expected to answer first.
+ *
+ * The pool is also the fetch policy of every lab: per-request timeouts
+ * from the latency history of a host, a retry budget per host and the
+ * backoff between retries. A crawler, whose URLs each have one host, adds
+ * hosts as it meets them with host_acquire_url().
+ *
+ * The structure holds no pointers so it can be placed in shared memory and
+ * used by several processes when initialized with pshared set.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+/* DEFINES */
+#define MAX_HOSTS    16     /* max number of servers in a HOST_POOL  */
+#define HOST_URL_LEN 128    /* max length of a server base URL       */
+#define EWMA_WEIGHT  0.2    /* weight of the newest latency sample   */
+#define HIST_BUCKETS 32     /* latency histogram buckets per host    */
+#define HIST_BASE    0.001  /* upper bound of bucket 0 in seconds    */
+#define HIST_GROWTH  1.5    /* ratio between consecutive bucket bounds */
+#define HIST_MAX     1024   /* counts are halved past this many samples
+                               so old latencies fade out             */
+#define HIST_MIN     10     /* samples needed before quantiles are used */
+#define TIMEOUT_MIN  1.0    /* shortest per-request timeout in seconds */
+#define TIMEOUT_MAX  10.0   /* per-request timeout, also used until a
+                               host has enough samples               */
+#define TIMEOUT_MULT 4      /* timeout is this many times the p99    */
+#define CONNECT_TIMEOUT 3.0 /* longest time to connect in seconds    */
+#define RETRY_BUDGET 10.0   /* failures a host may have in a row     */
+#define RETRY_REFUND 0.5    /* budget a success gives back           */
+#define BACKOFF_BASE 0.05   /* upper bound of the first backoff      */
+#define BACKOFF_MAX  2.0    /* upper bound of any backoff            */
+
+/* TYPEDEFS */
+typedef struct host {
+    char base_url[HOST_URL_LEN]; /* scheme://host:port, no trailing '/' */
+    int in_flight;               /* requests sent and not yet answered  */
+    double ewma;                 /* smoothed response time in seconds,
+                                    0 until the first response          */
+    long requests;               /* total requests sent to this host    */
+    int hist[HIST_BUCKETS];      /* response time histogram, bucket k
+                                    counts times up to HIST_BASE *
+                                    HIST_GROWTH^k seconds               */
+    int hist_count;              /* samples currently in hist           */
+    long hedges;                 /* hedge requests sent to this host    */
+    double retry_budget;         /* failures left before the host is
+                                    dropped, see host_release()         */
+    long failures;               /* failed or timed out requests        */
+} HOST;
+
+typedef struct host_pool {
+    pthread_mutex_t lock;        /* protects everything below */
+    int num_hosts;
+    HOST hosts[MAX_HOSTS];
+} HOST_POOL;
+
+/* FUNCTION PROTOTYPES */
+int host_pool_init(HOST_POOL *p, const char *list, int default_port, int pshared);
+void host_pool_destroy(HOST_POOL *p);
+int host_acquire(HOST_POOL *p);
+int host_acquire_other(HOST_POOL *p, int exclude);
+int host_acquire_url(HOST_POOL *p, const char *url);
+double host_quantile(HOST_POOL *p, int h, double q);
+void host_release(HOST_POOL *p, int h, double seconds, int ok);
+void host_cancel(HOST_POOL *p, int h);
+double host_timeout(HOST_POOL *p, int h);
+int host_pool_exhausted(HOST_POOL *p);
+int host_retryable(HOST_POOL *p, int h);
+int host_transient(CURLcode res);
+void host_pool_refill(HOST_POOL *p);
+double host_backoff(int attempt);
+const char *host_url(HOST_POOL *p, int h);
+void host_pool_report(HOST_POOL *p, FILE *fp);
@@ -0,0 +1,697 @@
+/**
+ * @file mock_server.c
+ * @brief stand-in for the ece252-N.uwaterloo.ca image servers, so that
+ *        paster and paster2 can be run and benchmarked without the network.
+ *
+ * Each PNG given on the command line is sliced into fragments of equal
+ * height (the last one takes the remainder) and served as image 1, 2, ...
+ *
+ *   GET /image?img=N          a random fragment of image N  (port 2520 style)
+ *   GET /image?img=N&part=K   fragment K of image N         (port 2530 style)
+ *
+ * Every reply carries the X-Ece252-Fragment header like the real servers,
+ * and an X-Ece252-Fragment-Count header they do not send, so that a client
+ * can paste images cut into other than the usual 50 fragments (see -n).
+ * Fragments are cut from the filtered scanlines as they are, so they are
+ * meant to be pasted back together rather than viewed on their own.
+ *
+ * Usage: mock_server [-a ADDR] [-p PORTS] [-l LATENCY] [-b BYTES_PER_SEC]
+ *                    [-f FAULTS] [-n FRAGMENTS] [-S SEED] [-v] PNG...
+ *
+ *   -a  IPv4 address to listen on. Default 127.0.0.1, use 0.0.0.0 to
+ *       serve other machines.
+ *   -p  comma separated ports, each optionally followed by :FACTOR to make
+ *       that "host" FACTOR times slower, e.g. 2520,2521:2,2522:4.
+ *       Default 2520,2530.
+ *   -l  time to first byte: fixed:MS, uniform:MIN_MS:MAX_MS, exp:MEAN_MS
+ *       or lognormal:MEDIAN_MS:SIGMA. Default none.
+ *   -b  per connection bandwidth cap in bytes per second. Default none.
+ *   -f  fault injection as comma separated KIND=PROBABILITY, where KIND
+ *       is 503 (error reply), reset (connection reset halfway through
+ *       the body) or hang (never reply), e.g. 503=0.01,hang=0.001
+ *   -n  fragments per image. Default 50.
+ *   -S  random seed, for repeatable runs. Default taken from the clock.
+ *   -v  log every request to stderr
+ */
+
+#define _GNU_SOURCE   /* for strcasestr() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "crc.h"      /* for crc()                   */
+#include "zutil.h"    /* for mem_def() and mem_inf_direct() */
+#include "lab_png.h"  /* simple PNG data structures  */
+
+/* DEFINES */
+#define DEFAULT_ADDR  "127.0.0.1"
+#define DEFAULT_PORTS "2520,2530"
+#define DEFAULT_FRAGS 50
+#define MAX_PORTS     16
+#define MAX_IMAGES    16
+#define REQ_MAX       4096     /* longest request header accepted */
+#define SEND_SLICE    4096     /* bytes per write() when bandwidth capped */
+#define ECE252_HEADER "X-Ece252-Fragment: "
+#define ECE252_COUNT_HEADER "X-Ece252-Fragment-Count: "
+
+enum { LAT_NONE, LAT_FIXED, LAT_UNIFORM, LAT_EXP, LAT_LOGNORMAL };
+enum { FAULT_NONE, FAULT_503, FAULT_RESET, FAULT_HANG };
+
+/* TYPEDEFS */
+typedef struct fragment {
+    U8 *buf;          /* a complete PNG file */
+    size_t len;
+} FRAGMENT;
+
+typedef struct frag_set {
+    FRAGMENT *frags;  /* num_frags fragments of one image */
+    int num_frags;
+} FRAG_SET;
+
+typedef struct latency {
+    int kind;         /* one of LAT_* */
+    double a;         /* fixed, min, mean or median, in seconds */
+    double b;         /* max in seconds, or sigma for LAT_LOGNORMAL */
+} LATENCY;
+
+typedef struct listener {
+    int fd;
+    int port;
+    double slowdown;  /* latency multiplier for this "host" */
+    pthread_t tid;
+} LISTENER;
+
+typedef struct conn {
+    int fd;
+    LISTENER *l;
+    unsigned int seed; /* for rand_r(), one stream per connection */
+} CONN;
+
+/* Set up in main() and read only afterwards */
+static FRAG_SET images[MAX_IMAGES];
+static int num_images = 0;
+static LATENCY latency = { LAT_NONE, 0, 0 };
+static long bandwidth = 0;             /* bytes per second, 0 for no cap */
+static double fault_p[FAULT_HANG + 1]; /* probability of each FAULT_* */
+static unsigned int base_seed = 0;
+static int verbose = 0;
+static unsigned int conn_count = 0;    /* accepted so far, read atomically */
+
+/* FUNCTION PROTOTYPES */
+int make_chunk(U8 *dst, const char *type, const U8 *data, U32 len);
+int slice_png(const char *path, int num_frags, FRAG_SET *out);
+int parse_latency(const char *spec, LATENCY *lat);
+int parse_faults(const char *spec);
+int parse_ports(const char *spec, LISTENER *ls, int *num);
+unsigned int mix_seed(unsigned int x);
+double sample_latency(const LATENCY *lat, unsigned int *seed);
+int send_all(int fd, const U8 *buf, size_t len, long rate);
+void *serve_conn(void *arg);
+void *accept_loop(void *arg);
+
+/**
+ * @brief write one PNG chunk (length, type, data, CRC) to dst
+ * @return number of bytes written, len + 12
+ */
+int make_chunk(U8 *dst, const char *type, const U8 *data, U32 len)
+{
+    U32 n = htonl(len);
+    U32 c = 0;
+
+    memcpy(dst, &n, CHUNK_LEN_SIZE);
+    memcpy(dst + CHUNK_LEN_SIZE, type, CHUNK_TYPE_SIZE);
+    if (len > 0) {
+        memcpy(dst + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE, data, len);
+    }
+    c = htonl(crc(dst + CHUNK_LEN_SIZE, CHUNK_TYPE_SIZE + len));
+    memcpy(dst + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + len, &c, CHUNK_CRC_SIZE);
+    return len + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + CHUNK_CRC_SIZE;
+}
+
+/**
+ * @brief read the PNG at path and cut it into num_frags horizontal strips,
+ *        each a PNG of its own. Every strip has height / num_frags rows
+ *        but the last, which also takes the rows left over.
+ * @return 0 on success; non-zero otherwise
+ */
+int slice_png(const char *path, int num_frags, FRAG_SET *out)
+{
+    static const int channels[] = { 1, 0, 3, 0, 2, 0, 4 };
+    U8 sig[PNG_SIG_SIZE] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+    U8 ihdr[DATA_IHDR_SIZE];
+    U8 *file = NULL, *idat = NULL, *raw = NULL;
+    U64 idat_len = 0, raw_len = 0;
+    long file_len = 0;
+    U32 width = 0, height = 0, stride = 0, rows = 0;
+    int have_ihdr = 0;
+    int ret = 1;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        perror(path);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    file_len = ftell(fp);
+    rewind(fp);
+    file = malloc(file_len);
+    idat = malloc(file_len);
+    if (file == NULL || idat == NULL || fread(file, 1, file_len, fp) != (size_t)file_len) {
+        fprintf(stderr, "%s: read failed\n", path);
+        goto done;
+    }
+    if (file_len < PNG_SIG_SIZE || memcmp(file, sig, PNG_SIG_SIZE) != 0) {
+        fprintf(stderr, "%s: not a PNG file\n", path);
+        goto done;
+    }
+
+    /* keep IHDR, join the IDAT chunks, ignore everything else */
+    for (long pos = PNG_SIG_SIZE; pos + 12 <= file_len; ) {
+        U32 len = 0;
+
+        memcpy(&len, file + pos, CHUNK_LEN_SIZE);
+        len = ntohl(len);
+        if (pos + 12 + (long)len > file_len) {
+            break;
+        }
+        if (memcmp(file + pos + 4, "IHDR", 4) == 0 && len == DATA_IHDR_SIZE) {
+            memcpy(ihdr, file + pos + 8, DATA_IHDR_SIZE);
+            have_ihdr = 1;
+        } else if (memcmp(file + pos + 4, "IDAT", 4) == 0) {
+            memcpy(idat + idat_len, file + pos + 8, len);
+            idat_len += len;
+        }
+        pos += 12 + len;
+    }
+    if (!have_ihdr || idat_len == 0) {
+        fprintf(stderr, "%s: no IHDR or IDAT chunk\n", path);
+        goto done;
+    }
+
+    memcpy(&width, ihdr, 4);
+    memcpy(&height, ihdr + 4, 4);
+    width = ntohl(width);
+    height = ntohl(height);
+    /* ihdr[8] bit depth, [9] color type, [12] interlace */
+    if (ihdr[9] > 6 || channels[ihdr[9]] == 0 || ihdr[12] != 0) {
+        fprintf(stderr, "%s: palette and interlaced images are not supported\n", path);
+        goto done;
+    }
+    if (height < (U32)num_frags) {
+        fprintf(stderr, "%s: %u rows cannot make %d fragments\n", path, height, num_frags);
+        goto done;
+    }
+    stride = 1 + (width * channels[ihdr[9]] * ihdr[8] + 7) / 8;
+    /* bounded by what IHDR says, so image data that inflates to more
+       than that is rejected instead of overrunning raw */
+    raw_len = (U64)stride * height;
+    raw = malloc(raw_len);
+    if (raw == NULL || mem_inf_direct(raw, &raw_len, idat, idat_len) != Z_OK ||
+        raw_len != (U64)stride * height) {
+        fprintf(stderr, "%s: bad image data\n", path);
+        goto done;
+    }
+
+    out->num_frags = num_frags;
+    out->frags = calloc(num_frags, sizeof(FRAGMENT));
+    rows = height / num_frags;
+    for (int i = 0; out->frags != NULL && i < num_frags; i++) {
+        U32 h = i < num_frags - 1 ? rows : height - rows * (num_frags - 1);
+        U64 src_len = (U64)stride * h;
+        U64 def_len = 0;
+        U8 *def = malloc(compressBound(src_len));
+        U8 *png = malloc(PNG_SIG_SIZE + 3 * 12 + DATA_IHDR_SIZE + compressBound(src_len));
+        U32 n = htonl(h);
+        size_t len = PNG_SIG_SIZE;
+
+        if (def == NULL || png == NULL ||
+            mem_def(def, &def_len, raw + (size_t)stride * rows * i, src_len, Z_DEFAULT_COMPRESSION) != 0) {
+            fprintf(stderr, "%s: deflate failed\n", path);
+            free(def);
+            free(png);
+            goto done;
+        }
+        memcpy(png, sig, PNG_SIG_SIZE);
+        memcpy(ihdr + 4, &n, 4);
+        len += make_chunk(png + len, "IHDR", ihdr, DATA_IHDR_SIZE);
+        len += make_chunk(png + len, "IDAT", def, def_len);
+        len += make_chunk(png + len, "IEND", NULL, 0);
+        free(def);
+        out->frags[i].buf = png;
+        out->frags[i].len = len;
+    }
+    ret = out->frags == NULL;
+
+done:
+    fclose(fp);
+    free(file);
+    free(idat);
+    free(raw);
+    return ret;
+}
+
+/**
+ * @brief parse a -l latency spec, see the file comment
+ * @return 0 on success; non-zero if spec is malformed
+ */
+int parse_latency(const char *spec, LATENCY *lat)
+{
+    double a = 0, b = 0;
+
+    if (sscanf(spec, "fixed:%lf", &a) == 1) {
+        lat->kind = LAT_FIXED;
+    } else if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 && b >= a) {
+        lat->kind = LAT_UNIFORM;
+        b /= 1000;
+    } else if (sscanf(spec, "exp:%lf", &a) == 1) {
+        lat->kind = LAT_EXP;
+    } else if (sscanf(spec, "lognormal:%lf:%lf", &a, &b) == 2 && b >= 0) {
+        lat->kind = LAT_LOGNORMAL;
+    } else {
+        return 1;
+    }
+    if (a < 0) {
+        return 1;
+    }
+    lat->a = a / 1000;
+    lat->b = b;
+    return 0;
+}
+
+/**
+ * @brief parse a -f fault spec, see the file comment
+ * @return 0 on success; non-zero if spec is malformed
+ */
+int parse_faults(const char *spec)
+{
+    char *copy = strdup(spec);
+    char *save = NULL;
+    double total = 0;
+    int ret = 0;
+
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        double p = eq != NULL ? strtod(eq + 1, NULL) : -1;
+        int kind = FAULT_NONE;
+
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+        if (strcmp(tok, "503") == 0) {
+            kind = FAULT_503;
+        } else if (strcmp(tok, "reset") == 0) {
+            kind = FAULT_RESET;
+        } else if (strcmp(tok, "hang") == 0) {
+            kind = FAULT_HANG;
+        }
+        if (kind == FAULT_NONE || p < 0 || p > 1) {
+            ret = 1;
+            break;
+        }
+        fault_p[kind] = p;
+        total += p;
+    }
+    free(copy);
+    return ret || total > 1;
+}
+
+/**
+ * @brief parse a -p port list, see the file comment
+ * @return 0 on success; non-zero if spec is malformed
+ */
+int parse_ports(const char *spec, LISTENER *ls, int *num)
+{
+    char *copy = strdup(spec);
+    char *save = NULL;
+    int ret = 0;
+
+    *num = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(tok, ':');
+
+        if (*num == MAX_PORTS) {
+            ret = 1;
+            break;
+        }
+        ls[*num].port = atoi(tok);
+        ls[*num].slowdown = colon != NULL ? strtod(colon + 1, NULL) : 1.0;
+        if (ls[*num].port <= 0 || ls[*num].port > 65535 || ls[*num].slowdown < 0) {
+            ret = 1;
+            break;
+        }
+        (*num)++;
+    }
+    free(copy);
+    return ret || *num == 0;
+}
+
+/**
+ * @brief scramble a seed, since rand_r() streams from consecutive seeds
+ *        start out almost alike and most connections are short
+ */
+unsigned int mix_seed(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * @brief draw one time to first byte from lat
+ * @return seconds
+ */
+double sample_latency(const LATENCY *lat, unsigned int *seed)
+{
+    /* uniform in (0, 1), never exactly 0 so that log() is safe */
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+
+    switch (lat->kind) {
+    case LAT_FIXED:
+        return lat->a;
+    case LAT_UNIFORM:
+        return lat->a + (lat->b - lat->a) * u;
+    case LAT_EXP:
+        return -lat->a * log(u);
+    case LAT_LOGNORMAL:
+        /* Box-Muller for a standard normal */
+        return lat->a * exp(lat->b * sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief write len bytes of buf to fd, no faster than rate bytes per
+ *        second if rate is non-zero
+ * @return 0 on success; non-zero if the peer went away
+ */
+int send_all(int fd, const U8 *buf, size_t len, long rate)
+{
+    struct timespec start, now;
+    size_t sent = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sent < len) {
+        size_t n = len - sent;
+        ssize_t w = 0;
+
+        if (rate > 0) {
+            double due = 0;
+
+            n = n < SEND_SLICE ? n : SEND_SLICE;
+            /* wait until the bytes sent so far are within the budget */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            due = (double)sent / rate - ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+            if (due > 0) {
+                usleep(due * 1000000);
+            }
+        }
+        w = send(fd, buf + sent, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return 1;
+        }
+        sent += w;
+    }
+    return 0;
+}
+
+/**
+ * @brief serve the requests of one connection until the client closes it
+ *        or asks for it to be closed
+ */
+void *serve_conn(void *arg)
+{
+    CONN *c = arg;
+    char req[REQ_MAX + 1];
+    size_t have = 0;
+    int keep_alive = 1;
+
+    req[0] = '\0';
+
+    while (keep_alive) {
+        char head[256];
+        char *end = NULL, *query = NULL;
+        int img = 0, part = -1, fault = FAULT_NONE, head_len = 0;
+        double delay = 0, u = 0;
+        const FRAGMENT *f = NULL;
+
+        /* read one request header */
+        while ((end = strstr(req, "\r\n\r\n")) == NULL) {
+            ssize_t r = 0;
+
+            if (have == REQ_MAX) {
+                goto out;     /* header too long */
+            }
+            r = recv(c->fd, req + have, REQ_MAX - have, 0);
+            if (r <= 0) {
+                goto out;
+            }
+            have += r;
+            req[have] = '\0';
+        }
+        *end = '\0';
+
+        if (strstr(req, "HTTP/1.0") != NULL || strcasestr(req, "\nConnection: close") != NULL) {
+            keep_alive = 0;
+        }
+        query = strchr(req, '?');
+        if (strncmp(req, "GET /image", 10) == 0 && query != NULL) {
+            char *p = strstr(query, "img=");
+            char *q = strstr(query, "part=");
+
+            img = p != NULL ? atoi(p + 4) : 0;
+            part = q != NULL ? atoi(q + 5) : -1;
+        }
+
+        /* drop the request just parsed, keep what a pipelining client sent after it */
+        have -= end + 4 - req;
+        memmove(req, end + 4, have);
+        req[have] = '\0';
+
+        if (img < 1 || img > num_images ||
+            (part >= 0 && part >= images[img - 1].num_frags)) {
+            head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+            if (send_all(c->fd, (U8 *)head, head_len, 0) != 0) {
+                goto out;
+            }
+            continue;
+        }
+        if (part < 0) {
+            part = rand_r(&c->seed) % images[img - 1].num_frags;
+        }
+        f = &images[img - 1].frags[part];
+
+        u = (double)rand_r(&c->seed) / RAND_MAX;
+        for (int k = FAULT_503; k <= FAULT_HANG && fault == FAULT_NONE; k++) {
+            if (u < fault_p[k]) {
+                fault = k;
+            }
+            u -= fault_p[k];
+        }
+        delay = sample_latency(&latency, &c->seed) * c->l->slowdown;
+        if (verbose) {
+            fprintf(stderr, "port %d: img=%d part=%d delay=%.1fms%s\n", c->l->port, img, part,
+                    delay * 1000, fault == FAULT_503 ? " 503" : fault == FAULT_RESET ? " reset" :
+                    fault == FAULT_HANG ? " hang" : "");
+        }
+        if (fault == FAULT_HANG) {
+            /* say nothing until the client gives up */
+            while (recv(c->fd, req, REQ_MAX, 0) > 0) {
+            }
+            goto out;
+        }
+        if (delay > 0) {
+            usleep(delay * 1000000);
+        }
+
+        if (fault == FAULT_503) {
+            head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+            if (send_all(c->fd, (U8 *)head, head_len, 0) != 0) {
+                goto out;
+            }
+            continue;
+        }
+        head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+                            "Content-Length: %zu\r\n" ECE252_HEADER "%d\r\n"
+                            ECE252_COUNT_HEADER "%d\r\n\r\n",
+                            f->len, part, images[img - 1].num_frags);
+        if (send_all(c->fd, (U8 *)head, head_len, bandwidth) != 0) {
+            goto out;
+        }
+        if (fault == FAULT_RESET) {
+            /* half the body, then a TCP reset instead of an orderly close */
+            struct linger lg = { 1, 0 };
+
+            send_all(c->fd, f->buf, f->len / 2, bandwidth);
+            setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            goto out;
+        }
+        if (send_all(c->fd, f->buf, f->len, bandwidth) != 0) {
+            goto out;
+        }
+    }
+
+out:
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+/**
+ * @brief accept connections on one port, each served by a thread of its own
+ */
+void *accept_loop(void *arg)
+{
+    LISTENER *l = arg;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        pthread_t tid;
+        CONN *c = NULL;
+        int fd = accept(l->fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+        c = malloc(sizeof(CONN));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->l = l;
+        c->seed = mix_seed(base_seed + __atomic_fetch_add(&conn_count, 1, __ATOMIC_RELAXED));
+        if (pthread_create(&tid, &attr, serve_conn, c) != 0) {
+            close(fd);
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    LISTENER ls[MAX_PORTS];
+    int num_ports = 0;
+    int num_frags = DEFAULT_FRAGS;
+    char *ports = DEFAULT_PORTS;
+    struct in_addr bind_addr;
+    int c;
+
+    base_seed = time(NULL) ^ getpid();
+    inet_pton(AF_INET, DEFAULT_ADDR, &bind_addr);
+    while ((c = getopt(argc, argv, "a:p:l:b:f:n:S:v")) != -1) {
+        switch (c) {
+        case 'a':
+            if (inet_pton(AF_INET, optarg, &bind_addr) != 1) {
+                fprintf(stderr, "%s: bad IPv4 address -- 'a'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case 'p':
+            ports = optarg;
+            break;
+        case 'l':
+            if (parse_latency(optarg, &latency) != 0) {
+                fprintf(stderr, "%s: bad latency spec -- 'l'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case 'b':
+            bandwidth = strtol(optarg, NULL, 10);
+            if (bandwidth <= 0) {
+                fprintf(stderr, "%s: option requires an argument > 0 -- 'b'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case 'f':
+            if (parse_faults(optarg) != 0) {
+                fprintf(stderr, "%s: bad fault spec -- 'f'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case 'n':
+            num_frags = atoi(optarg);
+            if (num_frags <= 0) {
+                fprintf(stderr, "%s: option requires an argument > 0 -- 'n'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case 'S':
+            base_seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (optind == argc || argc - optind > MAX_IMAGES) {
+        fprintf(stderr, "usage: %s [-a ADDR] [-p PORTS] [-l LATENCY] [-b BYTES_PER_SEC] "
+                "[-f FAULTS] [-n FRAGMENTS] [-S SEED] [-v] PNG...\n", argv[0]);
+        return -1;
+    }
+    if (parse_ports(ports, ls, &num_ports) != 0) {
+        fprintf(stderr, "%s: bad port list -- 'p'\n", argv[0]);
+        return -1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (slice_png(argv[i], num_frags, &images[num_images]) != 0) {
+            return -1;
+        }
+        num_images++;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < num_ports; i++) {
+        struct sockaddr_in addr;
+        int one = 1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr = bind_addr;
+        addr.sin_port = htons(ls[i].port);
+        ls[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(ls[i].fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (ls[i].fd < 0 || bind(ls[i].fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(ls[i].fd, 128) != 0) {
+            fprintf(stderr, "%s: port %d: %s\n", argv[0], ls[i].port, strerror(errno));
+            return -1;
+        }
+        pthread_create(&ls[i].tid, NULL, accept_loop, &ls[i]);
+        fprintf(stderr, "%s: serving %d image(s) of %d fragments on port %d\n",
+                argv[0], num_images, num_frags, ls[i].port);
+    }
+    for (int i = 0; i < num_ports; i++) {
+        pthread_join(ls[i].tid, NULL);
+    }
+    return 0;
+}
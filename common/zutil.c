@@ -73,6 +73,48 @@ int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
     return Z_OK;
 }
 
+/**
+ * @brief: deflate in memory data from source straight into dest with a
+ *         z_stream the caller keeps between calls. The stream is reset
+ *         rather than set up and torn down each time, so its window and
+ *         hash tables stay allocated from one image to the next.
+ * @param: strm z_stream* set up once with deflateInit() by the caller, who
+ *         also calls deflateEnd() on it when done. It sets the level.
+ * @param: dest U8* output buffer, caller supplies
+ * @param: dest_len, U64* in: capacity of dest in bytes, compressBound() of
+ *                        source_len is always enough,
+ *                        out: length of deflated data
+ * @param: source U8* source buffer, contains data to be deflated
+ * @param: source_len U64 length of source data
+ *
+ * @return =0  on success
+ *         <>0 error, Z_BUF_ERROR if dest is too small
+ */
+int mem_def_reuse(z_stream *strm, U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
+{
+    int ret = deflateReset(strm);
+
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm->avail_in = source_len;
+    strm->next_in = source;
+    strm->avail_out = *dest_len;
+    strm->next_out = dest;
+
+    ret = deflate(strm, Z_FINISH);
+    *dest_len = strm->total_out;
+
+    switch (ret) {
+    case Z_STREAM_END:
+        return Z_OK;
+    case Z_OK:
+        return Z_BUF_ERROR;
+    default:
+        return ret;
+    }
+}
+
 /**
  * @brief: inflate in memory data from source to dest 
  * @param: dest U8* output buffer, caller supplies, should be big enough
@@ -137,6 +179,92 @@ int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
     return (ret == Z_STREAM_END) ? Z_OK : Z_DATA_ERROR;
 }
 
+/**
+ * @brief: inflate in memory data from source straight into dest, without
+ *         going through an intermediate CHUNK buffer
+ * @param: dest U8* output buffer, caller supplies
+ * @param: dest_len, U64* in: capacity of dest in bytes,
+ *                        out: length of inflated data
+ * @param: source U8* source buffer, contains zlib data to be inflated
+ * @param: source_len U64 length of surce data
+ *
+ * @return =0  on success
+ *         <>0 error, Z_BUF_ERROR if dest is too small
+ */
+int mem_inf_direct(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
+{
+    z_stream strm;    /* pass info. to and from zlib routines   */
+    int ret = 0;      /* zlib return code                       */
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if (ret != Z_OK) {
+        return ret;
+    }
+
+    strm.avail_in = source_len;
+    strm.next_in = source;
+    strm.avail_out = *dest_len;
+    strm.next_out = dest;
+
+    /* the whole input and output are available, one call is enough */
+    ret = inflate(&strm, Z_FINISH);
+    *dest_len = strm.total_out;
+    (void) inflateEnd(&strm);
+
+    switch (ret) {
+    case Z_STREAM_END:
+        return Z_OK;
+    case Z_NEED_DICT:
+    case Z_OK:
+        return Z_DATA_ERROR;
+    default:
+        return ret;
+    }
+}
+
+/**
+ * @brief: mem_inf_direct() with a z_stream the caller keeps between calls.
+ *         The stream is reset rather than set up and torn down each time,
+ *         so its window and state stay allocated and warm in the cache
+ *         when many small buffers are inflated one after another.
+ * @param: strm z_stream* set up once with inflateInit() by the caller, who
+ *         also calls inflateEnd() on it when done
+ * @param: the others as for mem_inf_direct()
+ *
+ * @return =0  on success
+ *         <>0 error, Z_BUF_ERROR if dest is too small
+ */
+int mem_inf_reuse(z_stream *strm, U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
+{
+    int ret = inflateReset(strm);
+
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm->avail_in = source_len;
+    strm->next_in = source;
+    strm->avail_out = *dest_len;
+    strm->next_out = dest;
+
+    ret = inflate(strm, Z_FINISH);
+    *dest_len = strm->total_out;
+
+    switch (ret) {
+    case Z_STREAM_END:
+        return Z_OK;
+    case Z_NEED_DICT:
+    case Z_OK:
+        return Z_DATA_ERROR;
+    default:
+        return ret;
+    }
+}
+
 /* report a zlib or i/o error */
 void zerr(int ret)
 {
@@ -34,5 +34,8 @@ typedef unsigned long int U64;
 
 /* FUNCTION PROTOTYPES */
 int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level);
+int mem_def_reuse(z_stream *strm, U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
 int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
+int mem_inf_direct(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
+int mem_inf_reuse(z_stream *strm, U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
 void zerr(int ret);
@@ -0,0 +1,203 @@
+/**
+ * @file: frag_cache.c
+ * @brief: fragments kept on disk between runs, keyed by image and sequence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "crc.h"
+#include "frag_cache.h"
+
+#define PNG_SIG_LEN 8
+#define CHUNK_OVERHEAD 12    /* length, type and CRC fields of a chunk */
+
+static const unsigned char png_sig[PNG_SIG_LEN] = {
+    0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+};
+
+/**
+ * @brief: create the cache directory if it does not exist yet
+ * @return: 0 on success; non-zero if dir is not a usable directory
+ */
+int frag_cache_init(const char *dir)
+{
+    struct stat st;
+
+    if (dir == NULL || (mkdir(dir, 0777) != 0 && errno != EEXIST)) {
+        perror(dir);
+        return 1;
+    }
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || access(dir, R_OK | W_OK | X_OK) != 0) {
+        fprintf(stderr, "%s: not a writable directory\n", dir);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief: check that buf holds a PNG signature followed by whole chunks up
+ *         to and including IEND, each with a correct CRC
+ * @return: 1 if so; 0 otherwise
+ */
+int png_crc_ok(const unsigned char *buf, size_t len)
+{
+    size_t pos = PNG_SIG_LEN;
+
+    if (len < PNG_SIG_LEN || memcmp(buf, png_sig, PNG_SIG_LEN) != 0) {
+        return 0;
+    }
+    while (pos + CHUNK_OVERHEAD <= len) {
+        unsigned int n = 0, c = 0;
+
+        memcpy(&n, buf + pos, 4);
+        n = ntohl(n);
+        if (n > len - pos - CHUNK_OVERHEAD) {
+            return 0;
+        }
+        memcpy(&c, buf + pos + 8 + n, 4);
+        if (ntohl(c) != (unsigned int)crc((unsigned char *)buf + pos + 4, n + 4)) {
+            return 0;
+        }
+        if (memcmp(buf + pos + 4, "IEND", 4) == 0) {
+            return 1;
+        }
+        pos += CHUNK_OVERHEAD + n;
+    }
+    return 0;
+}
+
+/**
+ * @brief: read fragment seq of image img from the cache
+ * @param: p_buf char** set to a malloc'ed copy of the fragment, which the
+ *         caller frees
+ * @param: p_len size_t* set to the fragment length in bytes
+ * @return: 0 on a hit; non-zero if the fragment is missing or corrupt
+ */
+int frag_cache_get(const char *dir, int img, int seq, char **p_buf, size_t *p_len)
+{
+    char path[FRAG_CACHE_PATH_LEN];
+    struct stat st;
+    char *buf = NULL;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/img%d_%d.png", dir, img, seq);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 ||
+        (buf = malloc(st.st_size)) == NULL ||
+        read(fd, buf, st.st_size) != st.st_size ||
+        !png_crc_ok((unsigned char *)buf, st.st_size)) {
+        free(buf);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    *p_buf = buf;
+    *p_len = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief: write len bytes of buf to a temporary file made from the mkstemp()
+ *         template tmp and rename it over path, so concurrent writers of
+ *         the same file are harmless and readers see all of it or nothing
+ * @return: 0 on success; non-zero otherwise
+ */
+static int write_atomic(const char *path, char *tmp, const char *buf, size_t len)
+{
+    size_t done = 0;
+    int fd;
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return 1;
+    }
+    while (done < len) {
+        ssize_t w = write(fd, buf + done, len - done);
+
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            break;
+        }
+        done += w;
+    }
+    fchmod(fd, 0644);
+    if (close(fd) != 0 || done < len || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief: store fragment seq of image img unless it fails its CRC check, as
+ *         DIR/img<img>_<seq>.png
+ * @return: 0 on success; non-zero otherwise
+ */
+int frag_cache_put(const char *dir, int img, int seq, const char *buf, size_t len)
+{
+    char path[FRAG_CACHE_PATH_LEN];
+    char tmp[FRAG_CACHE_PATH_LEN];
+
+    if (!png_crc_ok((const unsigned char *)buf, len)) {
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/img%d_%d.png", dir, img, seq);
+    snprintf(tmp, sizeof(tmp), "%s/.img%d_%d.XXXXXX", dir, img, seq);
+    return write_atomic(path, tmp, buf, len);
+}
+
+/**
+ * @brief: read how many fragments image img has, as a server said in a run
+ *         before, from DIR/img<img>.count
+ * @param: p_num_frags int* set to the count, 0 if the server did not say
+ * @return: 0 on a hit; non-zero if the count is missing or unreadable
+ */
+int frag_cache_get_count(const char *dir, int img, int *p_num_frags)
+{
+    char path[FRAG_CACHE_PATH_LEN];
+    FILE *fp;
+    int n = 0;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/img%d.count", dir, img);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    ok = fscanf(fp, "%d", &n) == 1 && n >= 0;
+    fclose(fp);
+    if (!ok) {
+        return 1;
+    }
+    *p_num_frags = n;
+    return 0;
+}
+
+/**
+ * @brief: store how many fragments image img has, 0 if the server did not
+ *         say, so that a later run can go by the cached first fragment
+ *         without asking a server
+ * @return: 0 on success; non-zero otherwise
+ */
+int frag_cache_put_count(const char *dir, int img, int num_frags)
+{
+    char path[FRAG_CACHE_PATH_LEN];
+    char tmp[FRAG_CACHE_PATH_LEN];
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%d\n", num_frags);
+
+    snprintf(path, sizeof(path), "%s/img%d.count", dir, img);
+    snprintf(tmp, sizeof(tmp), "%s/.img%d.count.XXXXXX", dir, img);
+    return write_atomic(path, tmp, buf, len);
+}
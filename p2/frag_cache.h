@@ -0,0 +1,29 @@
+/**
+ * @file: frag_cache.h
+ * @brief: on-disk cache of image fragments. The fragment with sequence
+ *         number seq of image img is the same whichever server sends it,
+ *         so it is stored once as DIR/img<img>_<seq>.png and read back
+ *         instead of fetched on later runs.
+ *
+ * Files are written under a temporary name and renamed into place, so any
+ * number of processes may share one directory and a reader never sees half
+ * a fragment. Every chunk CRC is checked on the way in and on the way out;
+ * a fragment that fails is treated as missing. The number of fragments of
+ * an image, which a server sends with each of them, is kept beside them in
+ * DIR/img<img>.count.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* DEFINES */
+#define FRAG_CACHE_PATH_LEN 4096   /* max length of a fragment file path */
+
+/* FUNCTION PROTOTYPES */
+int frag_cache_init(const char *dir);
+int frag_cache_get(const char *dir, int img, int seq, char **p_buf, size_t *p_len);
+int frag_cache_put(const char *dir, int img, int seq, const char *buf, size_t len);
+int frag_cache_get_count(const char *dir, int img, int *p_num_frags);
+int frag_cache_put_count(const char *dir, int img, int num_frags);
+int png_crc_ok(const unsigned char *buf, size_t len);
@@ -24,46 +24,209 @@
  */ 
 
 
+#define _GNU_SOURCE   /* for struct ucred */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>   /* for strncasecmp()          */
 #include <sys/types.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include "lab_png.h"
 #include <errno.h>    /* for errno                   */
 #include "crc.h"      /* for crc()                   */
-#include "zutil.h"    /* for mem_def() and mem_inf() */
+#include "zutil.h"    /* for mem_def_reuse() and mem_inf() */
+#include "host_pool.h" /* for host_acquire()         */
+#include "frag_cache.h" /* for frag_cache_get()      */
+#include "buf_pool.h"  /* for buf_pool_get()          */
 #include <libgen.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <arpa/inet.h> /* for ntohl() and htonl()    */
+#include <time.h>      /* for clock_gettime()        */
+#include <limits.h>    /* for PATH_MAX               */
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>    /* for struct sockaddr_un     */
+#include <sys/stat.h>  /* for lstat()               */
+#include <poll.h>
 
 
 #define IMG_URL "http://ece252-1.uwaterloo.ca:2520/image?img=1"
 #define DUM_URL "https://example.com/"
 #define ECE252_HEADER "X-Ece252-Fragment: "
-#define BUF_SIZE 1048576  /* 1024*1024 = 1M */
-#define BUF_INC  524288   /* 1024*512  = 0.5M */
+#define ECE252_HOSTS "ece252-1.uwaterloo.ca,ece252-2.uwaterloo.ca,ece252-3.uwaterloo.ca"
+#define ECE252_PORT 2520
+#define BUF_MIN  16384    /* first allocation when there is no Content-Length */
+#define CONTENT_LENGTH_HEADER "Content-Length: "
+#define DUP_DRAIN_MAX 16384 /* a duplicate body up to this size is read and
+                               dropped rather than aborted, see dup_drop() */
+#define NUM_STRIPS 50     /* number of horizontal strips in one image */
+#define MAX_IMAGES 3      /* images on the server, numbered from 1 */
+#define BITS_PER_WORD (8 * sizeof(U64))
+#define INF_QUEUE_SIZE 256 /* max number of strips waiting to be inflated */
+#define IDAT_OFFSET 41    /* signature + IHDR chunk + IDAT length and type */
+#define STREAM_HEAD_LEN 29 /* signature + IHDR length, type and data */
+#define GEOM_OK    0      /* strip fits the image, see image_geometry() */
+#define GEOM_BAD   1      /* strip has the wrong width or height */
+#define GEOM_EARLY 2      /* last strip, before the geometry is known */
+#define STREAM_HEAD     0 /* collecting the signature and IHDR */
+#define STREAM_CHUNK    1 /* collecting the length and type of a chunk */
+#define STREAM_DATA     2 /* in the data field of a chunk */
+#define STREAM_CRC      3 /* in the CRC field of a chunk */
+#define STREAM_DONE     4 /* past IEND, anything after it is ignored */
+#define STREAM_BUFFERED 5 /* not streamed, the fragment goes to buf */
+#define HEDGE_PCT 90      /* default latency percentile that triggers a hedge */
+#define POLL_MS 1000      /* longest wait in curl_multi_poll() */
+#define HEDGE_POLL_MS 10  /* how often a hedge waiting for a window place looks */
+#define REQ_LINE_MAX (PATH_MAX + 16) /* longest daemon request line */
+#define REQ_TIMEOUT_MS 5000 /* time a daemon client has to send its request */
 #define max(a, b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
+#define min(a, b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
     
 
+/* Completion state of the NUM_STRIPS slots of one image. A set bit in done[]
+   means the slot has been claimed by the thread that fetched it; remaining
+   counts slots whose data has actually been stored. */
+typedef struct strip_set {
+    U64 done[(NUM_STRIPS + BITS_PER_WORD - 1) / BITS_PER_WORD];
+    int remaining;            /* strips not yet stored, 0 when image is full */
+    pthread_mutex_t lock;     /* only used to sleep on all_done */
+    pthread_cond_t all_done;  /* broadcast when remaining reaches 0 */
+} STRIP_SET;
+
+/* Inflate state of a fragment decoded as it is received (-i). The PNG
+   chunks are parsed on the fly and the IDAT data goes straight into
+   inflate(), which writes the rows at their place in the image. */
+typedef struct strip_stream {
+    struct image *img;  /* image the request is for */
+    int seq;            /* strip claimed for this transfer, -1 if none */
+    int state;          /* STREAM_HEAD to STREAM_BUFFERED */
+    U8 head[STREAM_HEAD_LEN]; /* signature and IHDR up to its CRC */
+    U8 chunk[CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE]; /* current chunk header */
+    U32 pos;            /* bytes of the current field seen so far */
+    U32 left;           /* bytes of the current data field still to come */
+    int idat;           /* the current chunk is an IDAT */
+    z_stream strm;      /* set up once the strip is claimed */
+    int ret;            /* last inflate() result */
+    U64 len;            /* bytes the strip inflates to */
+} STRIP_STREAM;
+
 typedef struct recv_buf2 {
     char *buf;       /* memory to hold a copy of received data */
     size_t size;     /* size of valid data in buf in bytes*/
     size_t max_size; /* max capacity of buf in bytes*/
     int seq;         /* >=0 sequence number extracted from http header */
                      /* <0 indicates an invalid seq number */
+    BUF_POOL *pool;  /* where buf comes from and goes back to, may be NULL */
+    size_t expected; /* Content-Length of the response, 0 if not sent */
+    STRIP_SET *dedup;/* if set, the body of a fragment already claimed in
+                        it is not kept, see dup_drop() */
+    int dup;         /* set when the transfer was cut short as a duplicate */
+    int drain;       /* set when the body of a duplicate is read and dropped */
+    STRIP_STREAM *stream; /* if set, the fragment is inflated as it arrives
+                             instead of stored in buf */
 } RECV_BUF;
 
 
+/* One image being assembled: the fetched fragments, which of them have been
+   stored and decoded, and the scanline buffer they are decoded into. All
+   strips but the last one must have the same height, so strip seq always
+   starts at row seq * strip_height. The last strip may be taller, with the
+   rows left over when the height of the image is not a multiple of
+   NUM_STRIPS. */
+typedef struct image {
+    int img_number;                 /* image number on the server */
+    RECV_BUF png_array[NUM_STRIPS]; /* fetched fragments indexed by seq */
+    STRIP_SET strips;               /* fragments stored in png_array */
+    STRIP_SET decoded;              /* fragments inflated into raw */
+    pthread_mutex_t lock;           /* protects the fields below */
+    U32 width;                      /* in pixels, set with raw */
+    U32 strip_height;               /* rows in every strip but the last */
+    U32 last_height;                /* rows in strip NUM_STRIPS - 1 */
+    U32 last_room;                  /* rows raw has for the last strip */
+    U8 *tail;                       /* the last strip, if it is taller than
+                                       last_room, until write_image() */
+    int last_pending;               /* last strip came before the geometry */
+    U8 *raw;                        /* filtered scanlines of the whole image */
+    int error;                      /* non-zero if a strip failed to decode */
+    int aborted;                    /* set by image_abort(), read atomically */
+    pthread_mutex_t win_lock;       /* protects in_flight, hedges_waiting */
+    pthread_cond_t win_cond;        /* signalled when a request finishes */
+    int in_flight;                  /* requests currently outstanding */
+    int hedges_waiting;             /* hedges that have the next places */
+    long requests;                  /* requests sent for this image */
+    long dup_count;                 /* requests that returned a duplicate */
+    long dup_bytes;                 /* body bytes received for duplicates */
+    const char *cache_dir;          /* fragment cache directory, may be NULL */
+    int cached;                     /* strips read from the cache */
+} IMAGE;
+
+/* A strip waiting to be inflated */
+typedef struct inf_task {
+    IMAGE *img;
+    int seq;
+} INF_TASK;
+
+/* Inflate worker pool fed by the fetch threads */
+typedef struct inf_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    INF_TASK tasks[INF_QUEUE_SIZE]; /* circular queue of pending strips */
+    int head;                       /* index of the oldest pending strip */
+    int count;                      /* number of pending strips */
+    int stop;                       /* set to make the workers exit */
+    int num_workers;
+    pthread_t *tids;
+} INF_POOL;
+
+
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
-int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+int dup_drop(RECV_BUF *p);
+int recv_buf_init(RECV_BUF *ptr, BUF_POOL *pool);
+int recv_buf_reserve(RECV_BUF *ptr, size_t max_size);
+int recv_buf_append(RECV_BUF *ptr, const char *data, size_t len);
 int recv_buf_cleanup(RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
+void strip_set_init(STRIP_SET *p, int n);
+void strip_set_destroy(STRIP_SET *p);
+int strip_claim(STRIP_SET *p, int seq);
+void strip_unclaim(STRIP_SET *p, int seq);
+void strip_complete(STRIP_SET *p);
+int strip_set_full(STRIP_SET *p);
+int strip_is_claimed(STRIP_SET *p, int seq);
+void strip_set_wait(STRIP_SET *p);
+int image_init(IMAGE *img, int img_number, BUF_POOL *pool);
+void image_cleanup(IMAGE *img);
+void image_abort(IMAGE *img);
+int image_aborted(IMAGE *img);
+void image_wait(IMAGE *img);
+int image_geometry(IMAGE *img, int seq, U32 width, U32 height, int park);
+int decode_strip(IMAGE *img, int seq);
+U8 *strip_rows(IMAGE *img, int seq, U32 height);
+void stream_init(STRIP_STREAM *s, IMAGE *img);
+int stream_start(RECV_BUF *p);
+int stream_write(RECV_BUF *p, const char *data, size_t len);
+int stream_end(STRIP_STREAM *s, int finished);
+int inf_pool_init(INF_POOL *pool, int num_workers);
+void inf_pool_submit(INF_POOL *pool, IMAGE *img, int seq);
+void inf_pool_shutdown(INF_POOL *pool);
+int write_png(const char *path, U32 width, U32 height, U8 *idat, U64 idat_len);
+int parse_image_list(const char *list, int *nums);
+int fetch_window(IMAGE *img, int max_in_flight);
+int window_enter(IMAGE *img, int max_in_flight);
+int window_try_enter(IMAGE *img, int max_in_flight);
+int window_hedge_enter(IMAGE *img, int max_in_flight, int *waiting);
+void window_hedge_cancel(IMAGE *img, int *waiting);
+void window_leave(IMAGE *img);
 
 
 /**
@@ -78,7 +241,11 @@ int write_file(const char *path, const void *in, size_t len);
  * @details this routine will be invoked multiple times by the libcurl until the full
  * header data are received.  we are only interested in the ECE252_HEADER line 
  * received so that we can extract the image sequence number from it. This
- * explains the if block in the code.
+ * explains the if block in the code. If the fragment is one we already
+ * have, returning 0 at the end of the header aborts the transfer before the
+ * body is downloaded, unless dup_drop() would rather read it.
+ * The Content-Length line is kept so that write_cb_curl3 can take a buffer
+ * of exactly the right size.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
 {
@@ -90,7 +257,14 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
 
         /* extract img sequence number */
 	p->seq = atoi(p_recv + strlen(ECE252_HEADER));
-
+    } else if (realsize > strlen(CONTENT_LENGTH_HEADER) &&
+               strncasecmp(p_recv, CONTENT_LENGTH_HEADER, strlen(CONTENT_LENGTH_HEADER)) == 0) {
+        p->expected = strtoul(p_recv + strlen(CONTENT_LENGTH_HEADER), NULL, 10);
+    } else if (realsize <= 2 && p->dedup != NULL && p->seq >= 0 && p->seq < NUM_STRIPS &&
+               strip_is_claimed(p->dedup, p->seq)) {
+        /* the blank line that ends the header: a fragment we already have,
+           stop before any of the body arrives */
+        return dup_drop(p) ? 0 : realsize;
     }
     return realsize;
 }
@@ -104,6 +278,12 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
  *        cast it to the proper struct to make good use of it.
  *        This function maybe invoked more than once by one invokation of
  *        curl_easy_perform().
+ *        By the first call all headers are in, so a fragment that another
+ *        request claimed since its header was seen is dropped here, see
+ *        dup_drop(): returning 0 makes libcurl abort the transfer
+ *        (CURLE_WRITE_ERROR). Otherwise the buffer is taken from the pool at the size
+ *        announced by Content-Length, or the data is inflated on the spot
+ *        if the transfer streams, see stream_write().
  */
 
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
@@ -111,43 +291,122 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     size_t realsize = size * nmemb;
     RECV_BUF *p = (RECV_BUF *)p_userdata;
  
-    if (p->size + realsize + 1 > p->max_size) {/* hope this rarely happens */ 
-        /* received data is not 0 terminated, add one byte for terminating 0 */
-        size_t new_size = p->max_size + max(BUF_INC, realsize + 1);   
-        char *q = realloc(p->buf, new_size);
-        if (q == NULL) {
-            perror("realloc"); /* out of memory */
-            return -1;
+    if (p->size == 0 && !p->drain) {
+        if (p->dedup != NULL && p->seq >= 0 && p->seq < NUM_STRIPS &&
+            strip_is_claimed(p->dedup, p->seq) && dup_drop(p)) {
+            p->size = realsize;   /* what we could not avoid receiving */
+            return 0;
         }
-        p->buf = q;
-        p->max_size = new_size;
+    }
+    if (p->drain) {
+        p->size += realsize;      /* counted, not kept */
+        return realsize;
     }
 
-    memcpy(p->buf + p->size, p_recv, realsize); /*copy data from libcurl*/
-    p->size += realsize;
-    p->buf[p->size] = 0;
-
-    return realsize;
+    if (p->stream != NULL) {
+        return stream_write(p, p_recv, realsize) == 0 ? realsize : 0;
+    }
+    return recv_buf_append(p, p_recv, realsize) == 0 ? realsize : -1;
 }
 
 
-int recv_buf_init(RECV_BUF *ptr, size_t max_size)
+/**
+ * @brief the fragment coming in on p is one we already have. Aborting the
+ *        transfer saves the rest of the body but closes the connection, so
+ *        a body of at most DUP_DRAIN_MAX bytes, about what a new connection
+ *        could carry in the round trip of its handshake, is read and
+ *        dropped instead and the connection is kept.
+ * @return non-zero if the transfer is to be aborted
+ */
+int dup_drop(RECV_BUF *p)
+{
+    if (p->expected > 0 && p->expected <= DUP_DRAIN_MAX) {
+        p->drain = 1;
+        return 0;
+    }
+    p->dup = 1;
+    return 1;
+}
+
+/**
+ * @brief initialize an empty receive buffer. No memory is taken until the
+ *        size of the response is known, see recv_buf_reserve().
+ * @param RECV_BUF *ptr the buffer to initialize
+ * @param BUF_POOL *pool pool to draw memory from, NULL to use malloc/free
+ */
+int recv_buf_init(RECV_BUF *ptr, BUF_POOL *pool)
 {
-    void *p = NULL;
-    
     if (ptr == NULL) {
         return 1;
     }
 
-    p = malloc(max_size);
+    ptr->buf = NULL;
+    ptr->size = 0;
+    ptr->max_size = 0;
+    ptr->seq = -1;              /* valid seq should be non-negative */
+    ptr->pool = pool;
+    ptr->expected = 0;
+    ptr->dedup = NULL;
+    ptr->dup = 0;
+    ptr->drain = 0;
+    ptr->stream = NULL;
+    return 0;
+}
+
+/**
+ * @brief give an empty receive buffer room for max_size bytes
+ * @return 0 on success; non-zero otherwise
+ */
+int recv_buf_reserve(RECV_BUF *ptr, size_t max_size)
+{
+    char *p = NULL;
+    size_t cap = max_size;
+
+    if (ptr == NULL || ptr->buf != NULL) {
+        return 1;
+    }
+
+    if (ptr->pool != NULL) {
+        p = buf_pool_get(ptr->pool, max_size, &cap);
+    } else {
+        p = malloc(max_size);
+    }
     if (p == NULL) {
-	return 2;
+        return 2;
     }
-    
+
     ptr->buf = p;
-    ptr->size = 0;
-    ptr->max_size = max_size;
-    ptr->seq = -1;              /* valid seq should be non-negative */
+    ptr->max_size = cap;
+    return 0;
+}
+
+/**
+ * @brief copy len bytes to the end of the data in ptr. The first call takes
+ *        the buffer, then it grows as needed.
+ * @return 0 on success; non-zero if out of memory
+ */
+int recv_buf_append(RECV_BUF *ptr, const char *data, size_t len)
+{
+    if (ptr->buf == NULL) {
+        /* one extra byte for the terminating 0, BUF_MIN for chunked responses */
+        if (recv_buf_reserve(ptr, ptr->expected > 0 ? ptr->expected + 1 : max(BUF_MIN, len + 1)) != 0) {
+            return 1;
+        }
+    }
+
+    if (ptr->size + len + 1 > ptr->max_size) {/* only without Content-Length */ 
+        /* received data is not 0 terminated, add one byte for terminating 0 */
+        char *q = buf_grow(ptr->buf, ptr->size + len + 1, &ptr->max_size);
+        if (q == NULL) {
+            perror("realloc"); /* out of memory */
+            return 1;
+        }
+        ptr->buf = q;
+    }
+
+    memcpy(ptr->buf + ptr->size, data, len); /*copy data from libcurl*/
+    ptr->size += len;
+    ptr->buf[ptr->size] = 0;
     return 0;
 }
 
@@ -157,13 +416,17 @@ int recv_buf_cleanup(RECV_BUF *ptr)
 	    return 1;
     }
     
-    free(ptr->buf);
+    if (ptr->buf != NULL && ptr->pool != NULL) {
+        buf_pool_put(ptr->pool, ptr->buf, ptr->max_size);
+    } else {
+        free(ptr->buf);
+    }
+    ptr->buf = NULL;
     ptr->size = 0;
     ptr->max_size = 0;
     return 0;
 }
 
-
 /**
  * @brief output data in memory to a file
  * @param path const char *, output file path
@@ -197,413 +460,1864 @@ int write_file(const char *path, const void *in, size_t len)
     }
     return fclose(fp);
 }
-struct pthread_args{
-    int thread_count;
-    int img_number;
-    RECV_BUF *png_array;
+/**
+ * @brief initialize the completion state of an image with n missing strips
+ */
+void strip_set_init(STRIP_SET *p, int n)
+{
+    memset(p->done, 0, sizeof(p->done));
+    p->remaining = n;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->all_done, NULL);
+}
 
-};
+void strip_set_destroy(STRIP_SET *p)
+{
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->all_done);
+}
 
-void *do_work(void *arg){
-    struct pthread_args *thread_arguments = arg;
-    int full=0;
-
-     while (full != 1){
-        CURL *curl_handle;
-        CURLcode res;
-        char url[256];
-        RECV_BUF recv_buf;
-        char fname[256];
-        pid_t pid =getpid();
-        
-        recv_buf_init(&recv_buf, BUF_SIZE);
-
-       
-        sprintf(url, "http://ece252-%d.uwaterloo.ca:2520/image?img=%d",thread_arguments->thread_count % 3 + 1 , thread_arguments -> img_number);
-       // printf("%s\n", url);
-       // printf("%s: URL is %s\n", argv[0], url);
-
-        curl_global_init(CURL_GLOBAL_DEFAULT);
-
-        /* init a curl session */
-        curl_handle = curl_easy_init();
-
-        if (curl_handle == NULL) {
-            fprintf(stderr, "curl_easy_init: returned NULL\n");
-            return 1;
+/**
+ * @brief claim slot seq for the calling thread
+ * @return 1 if the caller now owns the slot and must fill it and then call
+ *         strip_complete(); 0 if another thread already claimed it
+ */
+int strip_claim(STRIP_SET *p, int seq)
+{
+    U64 *word = &p->done[seq / BITS_PER_WORD];
+    U64 bit = 1UL << (seq % BITS_PER_WORD);
+    U64 old = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+    do {
+        if (old & bit) {
+            return 0;
         }
+    } while (!__atomic_compare_exchange_n(word, &old, old | bit, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/**
+ * @brief give back a claimed slot that will not be filled after all, so
+ *        that another thread can claim it
+ */
+void strip_unclaim(STRIP_SET *p, int seq)
+{
+    __atomic_and_fetch(&p->done[seq / BITS_PER_WORD], ~(1UL << (seq % BITS_PER_WORD)),
+                       __ATOMIC_RELEASE);
+}
 
-        /* specify URL to get */
-        curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+/**
+ * @brief mark a claimed slot as stored. The thread that stores the last
+ *        strip wakes everybody waiting in strip_set_wait().
+ */
+void strip_complete(STRIP_SET *p)
+{
+    if (__atomic_sub_fetch(&p->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->all_done);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
 
-        /* register write call back function to process received data */
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3); 
-        /* user defined data structure passed to the call back function */
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_buf);
+/**
+ * @return non-zero once every strip has been stored
+ */
+int strip_set_full(STRIP_SET *p)
+{
+    return __atomic_load_n(&p->remaining, __ATOMIC_ACQUIRE) == 0;
+}
 
-        /* register header call back function to process received header data */
-        curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl); 
-        /* user defined data structure passed to the call back function */
-        curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
+/**
+ * @return non-zero if slot seq has already been claimed
+ */
+int strip_is_claimed(STRIP_SET *p, int seq)
+{
+    U64 word = __atomic_load_n(&p->done[seq / BITS_PER_WORD], __ATOMIC_ACQUIRE);
 
-        /* some servers requires a user-agent field */
-        curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    return (word >> (seq % BITS_PER_WORD)) & 1;
+}
 
-        
-        /* get it! */
-        res = curl_easy_perform(curl_handle);
-        
-        if( res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        } else {
-           // printf("%lu bytes received in memory %p, seq=%d.\n", \
-                recv_buf.size, recv_buf.buf, recv_buf.seq);
-        }
-        
-        //assign to array of png strips
-        if (thread_arguments->png_array[recv_buf.seq].seq == -1){
-            thread_arguments->png_array[recv_buf.seq].seq = recv_buf.seq;
-            memcpy(thread_arguments->png_array[recv_buf.seq].buf, recv_buf.buf, recv_buf.size);
-            thread_arguments->png_array[recv_buf.seq].size = recv_buf.size;
-            thread_arguments->png_array[recv_buf.seq].max_size = recv_buf.max_size;
-            sprintf(fname, "./output_%d_%d.png", recv_buf.seq, pid);
+/**
+ * @brief block until every strip has been stored
+ */
+void strip_set_wait(STRIP_SET *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (!strip_set_full(p)) {
+        pthread_cond_wait(&p->all_done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
 
-            
-            //printf("i: %d\n", i);
+/**
+ * @brief initialize an image with all of its strips missing
+ * @return 0 on success; non-zero otherwise
+ */
+int image_init(IMAGE *img, int img_number, BUF_POOL *pool)
+{
+    img->img_number = img_number;
+    for (int i = 0; i < NUM_STRIPS; i++) {
+        recv_buf_init(&img->png_array[i], pool);
+    }
+    strip_set_init(&img->strips, NUM_STRIPS);
+    strip_set_init(&img->decoded, NUM_STRIPS);
+    pthread_mutex_init(&img->lock, NULL);
+    img->width = 0;
+    img->strip_height = 0;
+    img->last_height = 0;
+    img->last_room = 0;
+    img->tail = NULL;
+    img->last_pending = 0;
+    img->raw = NULL;
+    img->error = 0;
+    img->aborted = 0;
+    pthread_mutex_init(&img->win_lock, NULL);
+    pthread_cond_init(&img->win_cond, NULL);
+    img->in_flight = 0;
+    img->hedges_waiting = 0;
+    img->requests = 0;
+    img->dup_count = 0;
+    img->dup_bytes = 0;
+    img->cache_dir = NULL;
+    img->cached = 0;
+    return 0;
+}
 
-        }
-        full = 1;
-        for (int i = 0; i<50; i++){
-            if (thread_arguments->png_array[i].seq != i){
-                //printf("hleloehlo\n");
-                full = 0;
-            }
-        }
+void image_cleanup(IMAGE *img)
+{
+    for (int i = 0; i < NUM_STRIPS; i++) {
+        recv_buf_cleanup(&img->png_array[i]);
+    }
+    strip_set_destroy(&img->strips);
+    strip_set_destroy(&img->decoded);
+    pthread_mutex_destroy(&img->lock);
+    pthread_mutex_destroy(&img->win_lock);
+    pthread_cond_destroy(&img->win_cond);
+    free(img->raw);
+    img->raw = NULL;
+    free(img->tail);
+    img->tail = NULL;
+}
 
+/**
+ * @brief give up on img: wake every thread waiting for a window place or
+ *        in image_wait(), and stop every fetch loop working on it
+ */
+void image_abort(IMAGE *img)
+{
+    __atomic_store_n(&img->aborted, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&img->win_lock);
+    pthread_cond_broadcast(&img->win_cond);
+    pthread_mutex_unlock(&img->win_lock);
+    pthread_mutex_lock(&img->decoded.lock);
+    pthread_cond_broadcast(&img->decoded.all_done);
+    pthread_mutex_unlock(&img->decoded.lock);
+}
 
-        recv_buf_cleanup(&recv_buf);
-        curl_easy_cleanup(curl_handle);
-        curl_global_cleanup();
-        
+int image_aborted(IMAGE *img)
+{
+    return __atomic_load_n(&img->aborted, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief block until every strip of img is decoded or img is aborted
+ */
+void image_wait(IMAGE *img)
+{
+    pthread_mutex_lock(&img->decoded.lock);
+    while (!strip_set_full(&img->decoded) && !image_aborted(img)) {
+        pthread_cond_wait(&img->decoded.all_done, &img->decoded.lock);
     }
+    pthread_mutex_unlock(&img->decoded.lock);
 }
 
-int main( int argc, char** argv ) 
+/**
+ * @brief number of requests worth having in flight for img. Every request
+ *        returns one of the NUM_STRIPS fragments at random, so with r
+ *        strips missing the expected number of requests still needed is
+ *        NUM_STRIPS * (1 + 1/2 + ... + 1/r) (the coupon collector bound).
+ *        Keeping more than that in flight only buys duplicates.
+ * @param int max_in_flight the configured concurrency
+ * @return a window between 1 and max_in_flight
+ */
+int fetch_window(IMAGE *img, int max_in_flight)
 {
-    int c;
-    int t = 1;
-    int n = 1;
-    char *str = "option requires an argument";
-    
-    while ((c = getopt (argc, argv, "t:n:")) != -1) {
-        switch (c) {
-        case 't':
-	    t = strtoul(optarg, NULL, 10);
-	    //printf("option -t specifies a value of %d.\n", t);
-	    if (t <= 0) {
-                fprintf(stderr, "%s: %s > 0 -- 't'\n", argv[0], str);
-                return -1;
-            }
-            break;
-        case 'n':
-            n = strtoul(optarg, NULL, 10);
-	    //printf("option -n specifies a value of %d.\n", n);
-            if (n <= 0 || n > 3) {
-                fprintf(stderr, "%s: %s 1, 2, or 3 -- 'n'\n", argv[0], str);
-                return -1;
-            }
-            break;
-        default:
-            return -1;
+    int r = __atomic_load_n(&img->strips.remaining, __ATOMIC_ACQUIRE);
+    double expected = 0;
+
+    for (int k = 1; k <= r; k++) {
+        expected += (double)NUM_STRIPS / k;
+    }
+    if (expected < 1) {
+        return 1;
+    }
+    return expected < max_in_flight ? (int)(expected + 0.999) : max_in_flight;
+}
+
+/**
+ * @brief wait until a new request for img fits in the fetch window. Places
+ *        kept for hedges, see window_hedge_enter(), are not free.
+ * @return 1 if the caller may send a request, 0 if the image is full
+ */
+int window_enter(IMAGE *img, int max_in_flight)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&img->win_lock);
+    while (!strip_set_full(&img->strips) && !image_aborted(img) &&
+           img->in_flight + img->hedges_waiting >= fetch_window(img, max_in_flight)) {
+        pthread_cond_wait(&img->win_cond, &img->win_lock);
+    }
+    if (!strip_set_full(&img->strips) && !image_aborted(img)) {
+        img->in_flight++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&img->win_lock);
+    return ok;
+}
+
+/**
+ * @brief like window_enter() but never blocks
+ * @return 1 if the caller may send a request, 0 otherwise
+ */
+int window_try_enter(IMAGE *img, int max_in_flight)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&img->win_lock);
+    if (!strip_set_full(&img->strips) && !image_aborted(img) &&
+        img->in_flight + img->hedges_waiting < fetch_window(img, max_in_flight)) {
+        img->in_flight++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&img->win_lock);
+    return ok;
+}
+
+/**
+ * @brief take a place in the fetch window of img for the hedge of a slow
+ *        request, without blocking. A hedge goes before new requests: if
+ *        the window is full, the next place to come free is kept for it.
+ * @param int *waiting non-zero while a place is kept for this hedge
+ * @return 1 if the caller may send the hedge, 0 otherwise
+ */
+int window_hedge_enter(IMAGE *img, int max_in_flight, int *waiting)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&img->win_lock);
+    if (strip_set_full(&img->strips) || image_aborted(img)) {
+        /* nothing left to hedge for */
+    } else if (img->in_flight < fetch_window(img, max_in_flight)) {
+        img->in_flight++;
+        ok = 1;
+        if (*waiting) {
+            img->hedges_waiting--;
+            *waiting = 0;
         }
+    } else if (!*waiting) {
+        img->hedges_waiting++;
+        *waiting = 1;
+    }
+    pthread_mutex_unlock(&img->win_lock);
+    return ok;
+}
+
+/**
+ * @brief give back the place kept for a hedge of img that is not needed
+ *        any more, if one is
+ */
+void window_hedge_cancel(IMAGE *img, int *waiting)
+{
+    if (!*waiting) {
+        return;
     }
-    //printf("t: %i\n", t);
-    //printf("n: %i\n", n);
+    pthread_mutex_lock(&img->win_lock);
+    img->hedges_waiting--;
+    *waiting = 0;
+    pthread_cond_broadcast(&img->win_cond);
+    pthread_mutex_unlock(&img->win_lock);
+}
 
-    pthread_t *p_tids = malloc(sizeof(pthread_t) * t);
+/**
+ * @brief a request for img has finished, let a waiting thread in
+ */
+void window_leave(IMAGE *img)
+{
+    pthread_mutex_lock(&img->win_lock);
+    img->in_flight--;
+    pthread_cond_broadcast(&img->win_cond);
+    pthread_mutex_unlock(&img->win_lock);
+}
 
+/**
+ * @brief check a strip of width x height pixels against the geometry of
+ *        img. The first strip but the last fixes the geometry and allocates
+ *        img->raw, then decodes the last strip if it was parked before.
+ *        raw has room for a last strip as tall as the others, or exactly
+ *        for the last strip if that came first; see strip_rows() for one
+ *        that is taller.
+ * @param int park non-zero to park the last strip if it comes before the
+ *        geometry is known; decode_strip() is run on it later
+ * @return GEOM_OK, GEOM_BAD if the strip does not fit, or GEOM_EARLY if seq
+ *         is the last strip and the geometry is not known yet
+ */
+int image_geometry(IMAGE *img, int seq, U32 width, U32 height, int park)
+{
+    int last = (seq == NUM_STRIPS - 1);
+    int run_last = 0;
+    int bad = 0;
+
+    pthread_mutex_lock(&img->lock);
+    if (img->raw == NULL) {
+        if (last) {
+            img->last_height = height;
+            img->last_pending |= park;
+            pthread_mutex_unlock(&img->lock);
+            return GEOM_EARLY;
+        }
+        img->width = width;
+        img->strip_height = height;
+        img->last_room = img->last_height > 0 ? img->last_height : height;
+        img->raw = malloc(((U64)(NUM_STRIPS - 1) * height + img->last_room) * (width * 4 + 1));
+        if (img->raw == NULL) {
+            perror("malloc");
+            img->error = 1;
+        }
+        run_last = img->last_pending;
+        img->last_pending = 0;
+    }
+    if (last) {
+        img->last_height = height;
+    }
+    bad = img->raw == NULL || width != img->width ||
+          (last ? height == 0 : height != img->strip_height);
+    pthread_mutex_unlock(&img->lock);
 
-    RECV_BUF png_buffer[50];
-    for (int i =0 ; i < 50 ; i++){
-        recv_buf_init(&png_buffer[i], BUF_SIZE);
+    if (run_last) {
+        decode_strip(img, NUM_STRIPS - 1);
     }
-    
+    return bad ? GEOM_BAD : GEOM_OK;
+}
 
-    struct pthread_args array_of_args[t];
-    for (int i = 0; i < t; i++) {
-        array_of_args[i].thread_count = t;
-        array_of_args[i].img_number = n;
-        array_of_args[i].png_array=&png_buffer;
-        pthread_create(p_tids + i, NULL, do_work, array_of_args + i); 
+/**
+ * @return where the height rows of strip seq of img go: their place in
+ *         img->raw, or for a last strip taller than the room raw has for
+ *         it, img->tail, which write_image() moves in once nothing else
+ *         writes to raw. NULL if out of memory.
+ */
+U8 *strip_rows(IMAGE *img, int seq, U32 height)
+{
+    U64 stride = (U64)img->width * 4 + 1;   /* filter byte + 4 bytes per pixel */
 
+    if (seq == NUM_STRIPS - 1 && height > img->last_room) {
+        img->tail = malloc(height * stride);
+        if (img->tail == NULL) {
+            perror("malloc");
+        }
+        return img->tail;
     }
-    for (int i = 0; i < t; i++) {
-        pthread_join(p_tids[i], NULL);
+    return img->raw + seq * img->strip_height * stride;
+}
+
+/**
+ * @brief inflate strip seq of img straight into its final rows of img->raw.
+ *        The last strip may be shorter than the others, so if it arrives
+ *        before the geometry is known it is parked and decoded later, see
+ *        image_geometry().
+ * @return 0 on success; non-zero otherwise. Either way the strip is counted
+ *         in img->decoded so that nobody waits for it forever.
+ */
+int decode_strip(IMAGE *img, int seq)
+{
+    RECV_BUF *frag = &img->png_array[seq];
+    struct data_IHDR ihdr;
+    U32 idat_len = 0;
+    U32 width, height;
+    U64 stride, len, inf_len;
+    U8 *dest = NULL;
+    int ret;
+
+    if (frag->size < IDAT_OFFSET + CHUNK_CRC_SIZE) {
+        fprintf(stderr, "decode_strip: strip %d is too short\n", seq);
+        goto fail;
+    }
+    memcpy(&ihdr, frag->buf + PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE, DATA_IHDR_SIZE);
+    memcpy(&idat_len, frag->buf + IDAT_OFFSET - CHUNK_TYPE_SIZE - CHUNK_LEN_SIZE, CHUNK_LEN_SIZE);
+    width = ntohl(ihdr.width);
+    height = ntohl(ihdr.height);
+    idat_len = ntohl(idat_len);
+    if (IDAT_OFFSET + (U64)idat_len > frag->size) {
+        fprintf(stderr, "decode_strip: strip %d IDAT is truncated\n", seq);
+        goto fail;
     }
-    free(p_tids);
 
-    // char url[256];
-    //  sprintf(url, "http://ece252-%d.uwaterloo.ca:2520/image?img=%d",1, n);
-
-
-    // int i = 0;
-
-    // while (i != 50){
-    //     CURL *curl_handle;
-    //     CURLcode res;
-        
-    //     RECV_BUF recv_buf;
-    //     char fname[256];
-    //     pid_t pid =getpid();
-        
-    //     recv_buf_init(&recv_buf, BUF_SIZE);
-    //    // printf("%s: URL is %s\n", argv[0], url);
-
-    //     curl_global_init(CURL_GLOBAL_DEFAULT);
-
-    //     /* init a curl session */
-    //     curl_handle = curl_easy_init();
-
-    //     if (curl_handle == NULL) {
-    //         fprintf(stderr, "curl_easy_init: returned NULL\n");
-    //         return 1;
-    //     }
-
-    //     /* specify URL to get */
-    //     curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-
-    //     /* register write call back function to process received data */
-    //     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3); 
-    //     /* user defined data structure passed to the call back function */
-    //     curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_buf);
-
-    //     /* register header call back function to process received header data */
-    //     curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl); 
-    //     /* user defined data structure passed to the call back function */
-    //     curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
-
-    //     /* some servers requires a user-agent field */
-    //     curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-        
-    //     /* get it! */
-    //     res = curl_easy_perform(curl_handle);
-        
-    //     if( res != CURLE_OK) {
-    //         fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-    //     } else {
-    //         printf("%lu bytes received in memory %p, seq=%d.\n", \
-    //             recv_buf.size, recv_buf.buf, recv_buf.seq);
-    //     }
-        
-    //     //assign to array of png strips
-    //     if (png_buffer[recv_buf.seq].seq == -1){
-    //        // png_buffer[recv_buf.seq].seq = malloc(sizeof(struct simple_PNG) + 8);
-    //         png_buffer[recv_buf.seq].seq = recv_buf.seq;
-    //                 //memcpy(idat_chunk_length, png_buffer[i].buf + 33, 4);
-    //         memcpy(png_buffer[recv_buf.seq].buf, recv_buf.buf, recv_buf.size);
-    //        // png_buffer[recv_buf.seq].buf = recv_buf.buf;
-    //         png_buffer[recv_buf.seq].size = recv_buf.size;
-    //         png_buffer[recv_buf.seq].max_size = recv_buf.max_size;
-    //         sprintf(fname, "./output_%d_%d.png", recv_buf.seq, pid);
-    //         //printf("seq: %i" , recv_buf.seq);
-    //        // write_file(fname, png_buffer[recv_buf.seq].buf, png_buffer[recv_buf.seq].size);
-    //         //recv_buf_cleanup(&recv_buf);
-
-    //         i = i+1;
-    //         printf("i: %d\n", i);
-    //          //printf("mm: %u\n", &png_arr[recv_buf.seq]);
-
-    //     }
-
-
-    //     /* cleaning up */
-    //     //free(recv_buf.buf);
-    //     //recv_buf.size = 0;
-    //     //recv_buf.max_size = 0;
-
-    //     recv_buf_cleanup(&recv_buf);
-    //     curl_easy_cleanup(curl_handle);
-    //     curl_global_cleanup();
-        
-    // }
-    
-    //write_file("hello.png", png_buffer[2].buf, png_buffer[2].size);
-
-
-
-    //CONCAT
-    unsigned int total_height = 0;
-    unsigned int height = 0;
-    unsigned int width = 0;
-
-    char *inflated_buffer = malloc(9000000);
-   
-
-    U64 offset = 0;
-    for (int i =0 ; i < 50; i++ ){
-        //printf("fdsf2\n");
-        data_IHDR_p data_IHDR = malloc(DATA_IHDR_SIZE);
-       // printf("fdsf3\n");
-        memcpy(data_IHDR, png_buffer[i].buf + 16, 13);
-       // printf("fdsf4\n");
-        total_height += ntohl(data_IHDR -> height);
-        height = ntohl(data_IHDR -> height);
-
-        width = ntohl(data_IHDR->width);
-              // printf("height: %i\n", height);
-
-       //printf("total_height: %i\n", total_height);
-
-
-        //get idat
-        chunk_p idat_chunk_length = malloc(4);
-        memcpy(idat_chunk_length, png_buffer[i].buf + 33, 4);
-        //printf("fdsf1\n");
-       
-
-        chunk_p chunk_IDAT = malloc(12 + ntohl(idat_chunk_length->length));
-        memcpy(chunk_IDAT, png_buffer[i].buf +33, 12 + ntohl(idat_chunk_length->length));
-       
-
-        U8 *data_buffer = malloc(ntohl(chunk_IDAT->length)); 
-        memcpy(data_buffer, png_buffer[i].buf +41,  ntohl(chunk_IDAT->length));       
-                       
-        
-        int inflated_data_length = (height * (width *4 +1));
-        
-        
-        U64 *inflated_data = malloc((height * (width *4 +1)));
-
-        mem_inf(inflated_data, &inflated_data_length, data_buffer, ntohl(chunk_IDAT->length) );
-     
-        memcpy(inflated_buffer + offset, inflated_data, inflated_data_length);
-      
-        offset += inflated_data_length;
-        //free(inflated_data);
-        
-      
-        free(data_IHDR);
-        free(idat_chunk_length);
-        free(data_buffer);
-        free(chunk_IDAT);
-        free(inflated_data);
-    }
-    for (int i =0 ;i < 50 ; i ++){
-        recv_buf_cleanup(&png_buffer[i]);
-    }
-
-
-    U8 * deflated_data=malloc(2000000);
-    unsigned int deflated_data_length = 0;
-    
-    mem_def(deflated_data, &deflated_data_length, inflated_buffer, 9000000, Z_DEFAULT_COMPRESSION);
-
-    FILE * fp = fopen("all.png", "wb+");
-    U8 header[8];
-    header[0] = 0x89;
-    header[1] = 0x50;
-    header[2] = 0x4E;
-    header[3] = 0x47;
-    header[4] = 0x0D;
-    header[5] = 0x0A;
-    header[6] = 0x1A;
-    header[7] = 0x0A;
-
-    fwrite(header, 8, 1, fp);
-
-    U8 ihdr_length_type[8];
-    ihdr_length_type[0] = 0x00;
-    ihdr_length_type[1] = 0x00;
-    ihdr_length_type[2] = 0x00;
-    ihdr_length_type[3] = 0x0D;
-    ihdr_length_type[4] = 0x49;
-    ihdr_length_type[5] = 0x48;
-    ihdr_length_type[6] = 0x44;
-    ihdr_length_type[7] = 0x52;
-    fwrite(ihdr_length_type, 8, 1, fp);
-
-    width = htonl(width);
-    total_height = htonl(total_height);
-    fwrite(&width, 4, 1, fp);
-    fwrite(&total_height, 4, 1, fp);
-
-    U8 data_IHDR_remaining[5];
-    data_IHDR_remaining[0] = 0x08;
-    data_IHDR_remaining[1] = 0x06;
-    data_IHDR_remaining[2] = 0x00;
-    data_IHDR_remaining[3] = 0x00;
-    data_IHDR_remaining[4] = 0x00;
-    fwrite(data_IHDR_remaining, 5, 1, fp);
-
-    //read in ihdr type and data
-    U8 type_data_IHDR[17];
-    fseek(fp, 12, SEEK_SET);
-    fread(type_data_IHDR ,17, 1, fp);
-    U32 calculated_crc_IHDR = (htonl(crc((type_data_IHDR), 17)));
-    fseek(fp, 29, 0);
-    fwrite(&calculated_crc_IHDR, 4, 1, fp);
-
-    //idat
-    
-    unsigned int d = (deflated_data_length);
-    d = htonl(deflated_data_length);
-
-    fseek(fp, 33, 0);
-    fwrite((&d), 4,1,fp);
-    fseek(fp,37,0);
-    U8 idat_type[4];
-    idat_type[0] = 0x49;
-    idat_type[1] = 0x44;
-    idat_type[2] = 0x41;
-    idat_type[3] = 0x54;
-    fwrite(idat_type, 4, 1, fp);
-    
-    fseek(fp, 41, SEEK_SET);
-    fwrite(deflated_data, deflated_data_length, 1, fp);
-    
+    switch (image_geometry(img, seq, width, height, 1)) {
+    case GEOM_EARLY:
+        return 0;
+    case GEOM_BAD:
+        fprintf(stderr, "decode_strip: strip %d is %ux%u, expected width %u and height %u\n",
+                seq, width, height, img->width, img->strip_height);
+        goto fail;
+    }
 
-    //calculate crc
-    U8 type_data_IDAT[4+deflated_data_length];
-    fseek(fp, 37, SEEK_SET);
-    fread(type_data_IDAT ,4+deflated_data_length, 1, fp);
-    U32 calculated_crc_IDAT = (htonl(crc(type_data_IDAT, 4+deflated_data_length)));
-    fseek(fp,41+deflated_data_length , 0);
-    fwrite(&calculated_crc_IDAT, 4, 1, fp);
-
-    //iend
-    U8 iend_length[4];
-    iend_length[0] = 0x00;
-    iend_length[1] = 0x00;
-    iend_length[2] = 0x00;
-    iend_length[3] = 0x00;
-    fwrite(iend_length, 4,1,fp);
-
-    U8 iend_type[4];
-    iend_type[0] = 0x49;
-    iend_type[1] = 0x45;
-    iend_type[2] = 0x4E;
-    iend_type[3] = 0x44;
-    fwrite(iend_type, 4, 1, fp);
-
-
-    unsigned int calculated_crc_IEND = (htonl(crc(iend_type, 4)));
-    fseek(fp,53+deflated_data_length , 0);
-    fwrite(&calculated_crc_IEND, 4, 1, fp);
-
-    free(inflated_buffer);
-    free(deflated_data);
-    fclose(fp);
-    return 0;
+    stride = (U64)width * 4 + 1;   /* filter byte + 4 bytes per pixel */
+    len = height * stride;
+    inf_len = len;
+    dest = strip_rows(img, seq, height);
+    if (dest == NULL) {
+        goto fail;
+    }
+    ret = mem_inf_direct(dest, &inf_len, (U8 *)frag->buf + IDAT_OFFSET, idat_len);
+    if (ret != Z_OK || inf_len != len) {
+        fprintf(stderr, "decode_strip: strip %d: ", seq);
+        zerr(ret == Z_OK ? Z_DATA_ERROR : ret);
+        goto fail;
+    }
 
+    /* the compressed fragment is no longer needed */
+    recv_buf_cleanup(frag);
+    strip_complete(&img->decoded);
+    return 0;
 
+fail:
+    img->error = 1;
+    strip_complete(&img->decoded);
+    return 1;
+}
 
+/**
+ * @brief get s ready for a transfer of a fragment of img
+ */
+void stream_init(STRIP_STREAM *s, IMAGE *img)
+{
+    s->img = img;
+    s->seq = -1;
+    s->state = STREAM_HEAD;
+    s->pos = 0;
+    s->left = 0;
+    s->idat = 0;
+    s->ret = Z_OK;
+    s->len = 0;
+}
 
+/**
+ * @brief the signature and IHDR of the fragment in p are in. If the strip
+ *        fits the image, claim it and point inflate() at its rows.
+ *        Otherwise, as for the last strip before the geometry is known or
+ *        a fragment that is not what we expect, fall back to storing the
+ *        fragment in p->buf for decode_strip() to deal with.
+ * @return 0 on success; non-zero to abort the transfer
+ */
+int stream_start(RECV_BUF *p)
+{
+    STRIP_STREAM *s = p->stream;
+    IMAGE *img = s->img;
+    struct data_IHDR ihdr;
+    U32 ihdr_len = 0;
+    U32 width, height;
+    U64 stride;
+    int seq = p->seq;
+
+    memcpy(&ihdr_len, s->head + PNG_SIG_SIZE, CHUNK_LEN_SIZE);
+    memcpy(&ihdr, s->head + PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE, DATA_IHDR_SIZE);
+    width = ntohl(ihdr.width);
+    height = ntohl(ihdr.height);
+
+    if (seq < 0 || seq >= NUM_STRIPS || ntohl(ihdr_len) != DATA_IHDR_SIZE ||
+        memcmp(s->head + PNG_SIG_SIZE + CHUNK_LEN_SIZE, "IHDR", CHUNK_TYPE_SIZE) != 0 ||
+        image_geometry(img, seq, width, height, 0) != GEOM_OK ||
+        (seq == NUM_STRIPS - 1 && height > img->last_room)) {
+        s->state = STREAM_BUFFERED;
+        p->size = 0;
+        return recv_buf_append(p, (char *)s->head, STREAM_HEAD_LEN);
+    }
 
+    if (!strip_claim(&img->strips, seq)) {
+        /* another transfer got there first */
+        if (dup_drop(p)) {
+            return 1;
+        }
+        s->state = STREAM_DONE;
+        return 0;
+    }
+    memset(&s->strm, 0, sizeof(s->strm));
+    s->ret = inflateInit(&s->strm);
+    if (s->ret != Z_OK) {
+        strip_unclaim(&img->strips, seq);
+        return 1;
+    }
+    s->seq = seq;
+    stride = (U64)width * 4 + 1;   /* filter byte + 4 bytes per pixel */
+    s->len = height * stride;
+    s->strm.next_out = img->raw + seq * img->strip_height * stride;
+    s->strm.avail_out = s->len;
+    s->state = STREAM_CRC;
+    s->pos = 0;
+    return 0;
+}
 
+/**
+ * @brief take the next len bytes of a fragment. Chunk boundaries may fall
+ *        anywhere in data, so the parser keeps its place in s->state and
+ *        s->pos between calls.
+ * @return 0 to go on; non-zero to abort the transfer
+ */
+int stream_write(RECV_BUF *p, const char *data, size_t len)
+{
+    STRIP_STREAM *s = p->stream;
+
+    while (len > 0 && s->state != STREAM_BUFFERED) {
+        size_t k = 0;
+
+        switch (s->state) {
+        case STREAM_HEAD:
+            k = min(len, STREAM_HEAD_LEN - s->pos);
+            memcpy(s->head + s->pos, data, k);
+            s->pos += k;
+            p->size += k;
+            data += k;
+            len -= k;
+            if (s->pos == STREAM_HEAD_LEN && stream_start(p) != 0) {
+                return 1;
+            }
+            continue;
+        case STREAM_CHUNK:
+            k = min(len, sizeof(s->chunk) - s->pos);
+            memcpy(s->chunk + s->pos, data, k);
+            s->pos += k;
+            if (s->pos == sizeof(s->chunk)) {
+                U32 n = 0;
+
+                memcpy(&n, s->chunk, CHUNK_LEN_SIZE);
+                s->left = ntohl(n);
+                s->idat = memcmp(s->chunk + CHUNK_LEN_SIZE, "IDAT", CHUNK_TYPE_SIZE) == 0;
+                s->state = memcmp(s->chunk + CHUNK_LEN_SIZE, "IEND", CHUNK_TYPE_SIZE) == 0 ?
+                           STREAM_DONE : STREAM_DATA;
+                if (s->state == STREAM_DATA && s->left == 0) {
+                    /* an empty chunk: inflate() given no input fails with Z_BUF_ERROR */
+                    s->state = STREAM_CRC;
+                }
+                s->pos = 0;
+            }
+            break;
+        case STREAM_DATA:
+            k = min(len, s->left);
+            if (s->idat && s->ret == Z_OK) {
+                s->strm.next_in = (U8 *)data;
+                s->strm.avail_in = k;
+                s->ret = inflate(&s->strm, Z_NO_FLUSH);
+                if (s->ret == Z_OK && s->strm.avail_in > 0) {
+                    s->ret = Z_DATA_ERROR;   /* more data than the strip holds */
+                }
+                if (s->ret != Z_OK && s->ret != Z_STREAM_END) {
+                    return 1;
+                }
+            }
+            s->left -= k;
+            if (s->left == 0) {
+                s->state = STREAM_CRC;
+            }
+            break;
+        case STREAM_CRC:
+            k = min(len, CHUNK_CRC_SIZE - s->pos);
+            s->pos += k;
+            if (s->pos == CHUNK_CRC_SIZE) {
+                s->state = STREAM_CHUNK;
+                s->pos = 0;
+            }
+            break;
+        default:   /* STREAM_DONE */
+            k = len;
+            break;
+        }
+        p->size += k;
+        data += k;
+        len -= k;
+    }
 
+    if (len > 0) {
+        return recv_buf_append(p, data, len);
+    }
+    return 0;
+}
 
+/**
+ * @brief the transfer that streamed a strip is over. If the strip was
+ *        inflated in full it is stored and decoded at once; if the data
+ *        was corrupt the image fails, as in decode_strip(); if the transfer
+ *        stopped half way the strip is given back to be fetched again.
+ * @param int finished non-zero if the whole response was received
+ * @return 0 if the strip is done with; non-zero if it was given back
+ */
+int stream_end(STRIP_STREAM *s, int finished)
+{
+    IMAGE *img = s->img;
+    int seq = s->seq;
+    int ret = 0;
 
+    if (seq < 0) {
+        return 0;
+    }
+    if (s->ret == Z_STREAM_END && s->strm.total_out == s->len) {
+        strip_complete(&img->strips);
+        strip_complete(&img->decoded);
+    } else if (s->ret != Z_OK || finished) {
+        fprintf(stderr, "stream_end: strip %d: ", seq);
+        zerr(s->ret == Z_OK || s->ret == Z_STREAM_END ? Z_DATA_ERROR : s->ret);
+        img->error = 1;
+        strip_complete(&img->strips);
+        strip_complete(&img->decoded);
+    } else {
+        strip_unclaim(&img->strips, seq);
+        ret = 1;
+    }
+    inflateEnd(&s->strm);
+    s->seq = -1;
+    return ret;
 }
 
+void *inf_worker(void *arg)
+{
+    INF_POOL *pool = arg;
+    INF_TASK task;
 
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        task = pool->tasks[pool->head];
+        pool->head = (pool->head + 1) % INF_QUEUE_SIZE;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        decode_strip(task.img, task.seq);
+    }
+}
+
+/**
+ * @brief start num_workers inflate threads
+ * @return 0 on success; non-zero otherwise
+ */
+int inf_pool_init(INF_POOL *pool, int num_workers)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pool->head = 0;
+    pool->count = 0;
+    pool->stop = 0;
+    pool->num_workers = num_workers;
+    pool->tids = malloc(sizeof(pthread_t) * num_workers);
+    if (pool->tids == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_create(pool->tids + i, NULL, inf_worker, pool);
+    }
+    return 0;
+}
+
+/**
+ * @brief queue strip seq of img for inflation, blocks while the queue is full
+ */
+void inf_pool_submit(INF_POOL *pool, IMAGE *img, int seq)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == INF_QUEUE_SIZE) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    pool->tasks[(pool->head + pool->count) % INF_QUEUE_SIZE].img = img;
+    pool->tasks[(pool->head + pool->count) % INF_QUEUE_SIZE].seq = seq;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief let the workers drain the queue, then join them
+ */
+void inf_pool_shutdown(INF_POOL *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+    free(pool->tids);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+}
+
+/**
+ * @brief write one PNG chunk, the CRC covers the type and data fields
+ */
+int write_chunk(FILE *fp, const char *type, U8 *data, U32 len)
+{
+    U32 n_len = htonl(len);
+    U32 n_crc = 0;
+    unsigned long c = 0;
+
+    c = update_crc(0xffffffffL, (U8 *)type, CHUNK_TYPE_SIZE);
+    c = update_crc(c, data, len) ^ 0xffffffffL;
+    n_crc = htonl(c);
+
+    if (fwrite(&n_len, CHUNK_LEN_SIZE, 1, fp) != 1 ||
+        fwrite(type, CHUNK_TYPE_SIZE, 1, fp) != 1 ||
+        (len > 0 && fwrite(data, len, 1, fp) != 1) ||
+        fwrite(&n_crc, CHUNK_CRC_SIZE, 1, fp) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief write an 8-bit RGBA PNG with a single IDAT chunk
+ * @param path const char *, output file path
+ * @param width U32, image width in pixels
+ * @param height U32, image height in pixels
+ * @param idat U8 *, deflated scanlines
+ * @param idat_len U64, length of idat in bytes
+ * @return 0 on success; non-zero otherwise
+ */
+int write_png(const char *path, U32 width, U32 height, U8 *idat, U64 idat_len)
+{
+    U8 sig[PNG_SIG_SIZE] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+    U8 ihdr[DATA_IHDR_SIZE];
+    U32 n_width = htonl(width);
+    U32 n_height = htonl(height);
+    FILE *fp = NULL;
+    int ret = 0;
+
+    memcpy(ihdr, &n_width, 4);
+    memcpy(ihdr + 4, &n_height, 4);
+    ihdr[8] = 8;   /* bit depth                        */
+    ihdr[9] = 6;   /* color type: truecolor with alpha */
+    ihdr[10] = 0;  /* compression method               */
+    ihdr[11] = 0;  /* filter method                    */
+    ihdr[12] = 0;  /* no interlace                     */
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("fopen");
+        return -2;
+    }
+    if (fwrite(sig, PNG_SIG_SIZE, 1, fp) != 1 ||
+        write_chunk(fp, "IHDR", ihdr, DATA_IHDR_SIZE) != 0 ||
+        write_chunk(fp, "IDAT", idat, idat_len) != 0 ||
+        write_chunk(fp, "IEND", NULL, 0) != 0) {
+        fprintf(stderr, "write_png: imcomplete write!\n");
+        ret = -3;
+    }
+    if (fclose(fp) != 0) {
+        ret = -3;
+    }
+    return ret;
+}
+
+/**
+ * @brief parse the -n argument, a comma separated list of distinct image
+ *        numbers such as "1,2,3"
+ * @param int *nums receives the image numbers, MAX_IMAGES at most
+ * @return number of images in the list; -1 if it is malformed
+ */
+int parse_image_list(const char *list, int *nums)
+{
+    int count = 0;
+    const char *p = list;
+
+    while (1) {
+        char *end = NULL;
+        long v = strtol(p, &end, 10);
+
+        if (end == p || v < 1 || v > MAX_IMAGES || count == MAX_IMAGES) {
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            if (nums[i] == v) {
+                return -1;
+            }
+        }
+        nums[count++] = v;
+        if (*end == '\0') {
+            return count;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+}
+
+/* An image of the batch and the file it is written to */
+typedef struct output_job {
+    IMAGE *img;
+    char path[PATH_MAX];
+    z_stream *def;   /* deflate stream of this writer, see mem_def_reuse() */
+    int ret;         /* 0 once written, non-zero if it could not be */
+    pthread_t tid;
+} OUTPUT_JOB;
+
+/**
+ * @brief writer thread: wait until every strip of an image is decoded,
+ *        then deflate it and write it out. There is one per image, so an
+ *        image is compressed while the fetch threads work on the next one.
+ */
+void *write_image(void *arg)
+{
+    OUTPUT_JOB *job = arg;
+    IMAGE *img = job->img;
+    U32 total_height;
+    U64 raw_len;
+    U8 *deflated_data = NULL;
+    U64 deflated_data_length = 0;
+
+    /* strips are inflated as they arrive, so once the last one is decoded
+       only the deflate of the whole image is left. A fetch loop that gives
+       up aborts the image, which ends the wait as well. */
+    image_wait(img);
+    if (img->error || image_aborted(img)) {
+        job->ret = 1;
+        return NULL;
+    }
+
+    total_height = (NUM_STRIPS - 1) * img->strip_height + img->last_height;
+    raw_len = (U64)total_height * (img->width * 4 + 1);
+    if (img->tail != NULL) {
+        /* a last strip taller than the others joins the rest now */
+        U64 head_len = raw_len - (U64)img->last_height * (img->width * 4 + 1);
+        U8 *p = realloc(img->raw, raw_len);
+
+        if (p == NULL) {
+            perror("realloc");
+            job->ret = 1;
+            return NULL;
+        }
+        img->raw = p;
+        memcpy(img->raw + head_len, img->tail, raw_len - head_len);
+        free(img->tail);
+        img->tail = NULL;
+    }
+    deflated_data_length = compressBound(raw_len);
+    deflated_data = malloc(deflated_data_length);
+    job->ret = deflated_data == NULL ||
+        mem_def_reuse(job->def, deflated_data, &deflated_data_length, img->raw, raw_len) != Z_OK ||
+        write_png(job->path, img->width, total_height, deflated_data, deflated_data_length) != 0;
+    free(deflated_data);
+    return NULL;
+}
+
+/* When fetch_loop() hedges, retries and gives up */
+typedef struct fetch_policy {
+    int hedge_pct;   /* latency percentile that triggers a hedge, 0 for none */
+    double deadline; /* now() by which the whole job must be done, 0 for none */
+    int stream;      /* inflate fragments as they arrive, see stream_write() */
+} FETCH_POLICY;
+
+struct pthread_args{
+    IMAGE **imgs;    /* images this thread collects strips for, in order */
+    int num_imgs;
+    INF_POOL *inf;   /* where new strips are sent to be inflated */
+    BUF_POOL *pool;  /* receive buffers, shared by all threads */
+    CURLSH *share;   /* DNS, connection and TLS session cache shared by all threads */
+    HOST_POOL *hosts; /* servers to spread the requests over */
+    int max_in_flight; /* upper bound of the fetch window, see fetch_window() */
+    const FETCH_POLICY *policy; /* when to hedge, retry and give up */
+};
+
+/**
+ * @brief lock/unlock call backs for the CURLSH share object. Each kind of
+ *        shared data (DNS, connections, TLS sessions) gets its own mutex
+ *        so that a DNS lookup does not block a connection being returned
+ *        to the pool.
+ */
+static pthread_mutex_t share_lock[CURL_LOCK_DATA_LAST];
+
+void share_lock_cb(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    pthread_mutex_lock(&share_lock[data]);
+}
+
+void share_unlock_cb(CURL *handle, curl_lock_data data, void *userptr)
+{
+    pthread_mutex_unlock(&share_lock[data]);
+}
+
+/**
+ * @brief create the share object used by every fetch thread
+ * @return NULL on failure
+ */
+CURLSH *share_init(void)
+{
+    CURLSH *share = curl_share_init();
+
+    if (share == NULL) {
+        fprintf(stderr, "curl_share_init: returned NULL\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share_lock[i], NULL);
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return share;
+}
+
+void share_cleanup(CURLSH *share)
+{
+    curl_share_cleanup(share);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&share_lock[i]);
+    }
+}
+
+/**
+ * @brief create an easy handle with the options that stay the same for
+ *        every request it makes
+ * @param RECV_BUF *ptr receive buffer passed to the header and write call backs
+ * @param CURLSH *share share object for DNS, connections and TLS sessions
+ * @return NULL on failure
+ * NOTE: the URL is set per request, see start_transfer()
+ */
+CURL *easy_handle_init(RECV_BUF *ptr, CURLSH *share)
+{
+    /* init a curl session */
+    CURL *curl_handle = curl_easy_init();
+
+    if (curl_handle == NULL) {
+        fprintf(stderr, "curl_easy_init: returned NULL\n");
+        return NULL;
+    }
+
+    /* register write call back function to process received data */
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3); 
+    /* user defined data structure passed to the call back function */
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)ptr);
+
+    /* register header call back function to process received header data */
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl); 
+    /* user defined data structure passed to the call back function */
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)ptr);
+
+    /* some servers requires a user-agent field */
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+    /* reuse DNS results, connections and TLS sessions across handles */
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, share);
+
+    return curl_handle;
+}
+
+/**
+ * @brief check the reply to a request that cURL completed. An error page,
+ *        such as a 503, carries no fragment and counts as a failure.
+ * @return non-zero if the reply is a fragment
+ */
+int request_ok(CURL *curl_handle, RECV_BUF *p_recv_buf)
+{
+    long code = 0;
+
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &code);
+    return code < 400 && p_recv_buf->seq >= 0;
+}
+
+/**
+ * @brief report how long the request on curl_handle took to its host. A
+ *        duplicate cut short says nothing about how long a whole answer
+ *        takes, so it is not counted as a latency sample.
+ */
+void release_request(CURL *curl_handle, HOST_POOL *hosts, int h, CURLcode res, int dup)
+{
+    double seconds = 0;
+
+    if (dup) {
+        host_cancel(hosts, h);
+        return;
+    }
+    curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME, &seconds);
+    host_release(hosts, h, seconds, res == CURLE_OK);
+}
+
+/**
+ * @brief keep the fragment received in p_recv_buf if it is one we do not
+ *        have yet. The slot takes over the buffer, nothing is copied, and
+ *        the strip is queued for inflation right away. A new fragment is
+ *        also saved to the cache, if there is one.
+ * @return 1 if the fragment was new, 0 if it was a duplicate
+ */
+int store_strip(IMAGE *img, INF_POOL *inf, RECV_BUF *p_recv_buf)
+{
+    int seq = p_recv_buf->seq;
+
+    if (seq < 0 || seq >= NUM_STRIPS || !strip_claim(&img->strips, seq)) {
+        return 0;
+    }
+
+    if (img->cache_dir != NULL) {
+        frag_cache_put(img->cache_dir, img->img_number, seq,
+                       p_recv_buf->buf, p_recv_buf->size);
+    }
+    img->png_array[seq] = *p_recv_buf;
+    p_recv_buf->buf = NULL;
+    strip_complete(&img->strips);
+    inf_pool_submit(inf, img, seq);
+    return 1;
+}
+
+/**
+ * @brief fill img with every fragment found in its cache directory and
+ *        queue them for inflation, before any request is made
+ * @return number of strips read from the cache
+ */
+int image_load_cache(IMAGE *img, INF_POOL *inf)
+{
+    for (int seq = 0; seq < NUM_STRIPS; seq++) {
+        RECV_BUF *frag = &img->png_array[seq];
+        char *buf = NULL;
+        size_t len = 0;
+
+        if (frag_cache_get(img->cache_dir, img->img_number, seq, &buf, &len) != 0) {
+            continue;
+        }
+        if (!strip_claim(&img->strips, seq)) {
+            free(buf);
+            continue;
+        }
+        frag->buf = buf;
+        frag->size = len;
+        frag->max_size = len;
+        frag->seq = seq;
+        img->cached++;
+        strip_complete(&img->strips);
+        inf_pool_submit(inf, img, seq);
+    }
+    return img->cached;
+}
+
+/**
+ * @brief deal with a finished request: store the fragment if it is new,
+ *        otherwise account for the bytes it wasted. A streamed strip is
+ *        already inflated and only has to be counted.
+ */
+void finish_request(IMAGE *img, INF_POOL *inf, RECV_BUF *p_recv_buf, CURLcode res)
+{
+    __atomic_add_fetch(&img->requests, 1, __ATOMIC_RELAXED);
+
+    if (p_recv_buf->stream != NULL && p_recv_buf->stream->seq >= 0) {
+        if (stream_end(p_recv_buf->stream, res == CURLE_OK) != 0) {
+            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        }
+        return;
+    }
+    if (p_recv_buf->dup || p_recv_buf->drain) {
+        /* cut short or dropped by dup_drop(), not an error */
+    } else if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        return;
+    } else if (store_strip(img, inf, p_recv_buf)) {
+        return;
+    }
+    /* a duplicate, either caught early or completed in a race */
+    __atomic_add_fetch(&img->dup_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&img->dup_bytes, p_recv_buf->size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return seconds on a monotonic clock
+ */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+/* One transfer slot of fetch_loop(). Slot i < n sends requests and slot
+   i + n is its hedge: the same request sent to another host when slot i
+   is slower than the HEDGE_PCT latency percentile of its host. Each
+   running request, hedge or not, holds a place in its image's window. */
+typedef struct transfer {
+    CURL *eh;        /* easy handle, kept for the life of the loop */
+    RECV_BUF buf;    /* where the response goes */
+    STRIP_STREAM stream; /* inflate state if the policy streams */
+    IMAGE *img;      /* image the request is for */
+    int host;        /* host the request went to, -1 if the slot is idle */
+    double start;    /* when the request was sent, see now() */
+    int failures;    /* failed requests in a row on this slot */
+    double not_before; /* no new request before this time, see now() */
+    int hedged;      /* the request of slot i < n has had its hedge */
+    int hedge_waiting; /* a window place is kept for that hedge */
+} TRANSFER;
+
+/**
+ * @brief send a request for img on slot t, to host h or, if h < 0, to the
+ *        host picked by host_acquire(). The request may take as long as
+ *        host_timeout() allows, but never past the deadline of the job.
+ */
+void start_transfer(CURLM *cm, TRANSFER *t, IMAGE *img, BUF_POOL *pool,
+                    HOST_POOL *hosts, int h, const FETCH_POLICY *policy)
+{
+    char url[256];
+    double timeout = 0;
+
+    recv_buf_init(&t->buf, pool);
+    t->buf.dedup = &img->strips;
+    if (policy->stream) {
+        stream_init(&t->stream, img);
+        t->buf.stream = &t->stream;
+    }
+    t->img = img;
+    t->host = h < 0 ? host_acquire(hosts) : h;
+    snprintf(url, sizeof(url), "%s/image?img=%d", host_url(hosts, t->host), img->img_number);
+    curl_easy_setopt(t->eh, CURLOPT_URL, url);
+    t->start = now();
+
+    timeout = host_timeout(hosts, t->host);
+    if (policy->deadline > 0 && policy->deadline - t->start < timeout) {
+        timeout = policy->deadline - t->start;
+    }
+    curl_easy_setopt(t->eh, CURLOPT_TIMEOUT_MS, (long)(timeout * 1000) + 1);
+    curl_easy_setopt(t->eh, CURLOPT_CONNECTTIMEOUT_MS,
+                     (long)((timeout < CONNECT_TIMEOUT ? timeout : CONNECT_TIMEOUT) * 1000) + 1);
+    curl_multi_add_handle(cm, t->eh);
+}
+
+/**
+ * @brief stop the request on slot t before it finishes
+ * @param int sample non-zero to still count the time it ran as a latency
+ *        sample of its host. A request that lost to its hedge was slow,
+ *        and dropping that time would make the host look faster than it is.
+ */
+void cancel_transfer(CURLM *cm, TRANSFER *t, HOST_POOL *hosts, int sample)
+{
+    if (t->host < 0) {
+        return;
+    }
+    curl_multi_remove_handle(cm, t->eh);
+    if (sample) {
+        host_release(hosts, t->host, now() - t->start, 1);
+    } else {
+        host_cancel(hosts, t->host);
+    }
+    if (t->buf.stream != NULL) {
+        stream_end(t->buf.stream, 0);
+    }
+    recv_buf_cleanup(&t->buf);
+    t->host = -1;
+}
+
+/**
+ * @return non-zero if the request on slot t can only bring a strip that is
+ *         stored already. Until its header is in that cannot be told, and
+ *         a duplicate being read to the end to keep its connection, see
+ *         dup_drop(), is about to finish anyway.
+ */
+int transfer_redundant(TRANSFER *t)
+{
+    int seq = t->buf.seq;
+
+    if (t->buf.drain || (t->buf.stream != NULL && t->stream.seq >= 0)) {
+        return 0;   /* or streaming the strip it claimed itself */
+    }
+    return seq >= 0 && seq < NUM_STRIPS && strip_is_claimed(&t->img->strips, seq);
+}
+
+/**
+ * @brief fetch loop: drive up to num_transfers concurrent requests from the
+ *        calling thread with one multi handle. Whenever a transfer finishes
+ *        its easy handle is put straight back so the window stays full
+ *        until every strip of every image in imgs has been stored. Each
+ *        image has a window shared by every loop working on it, which
+ *        shrinks as the image fills, see fetch_window(). A slot goes to the
+ *        oldest image with room in its window, so the tail of one image
+ *        overlaps the start of the next instead of leaving the network idle.
+ *        A request still running after the hedge_pct latency percentile of
+ *        its host is duplicated to another host, once, so one slow response
+ *        does not hold up the whole image. The hedge needs a window place of
+ *        its own and gets the next one before any new request does. When
+ *        one of the pair finishes, the other is only cancelled if it is
+ *        bringing a strip already stored: the server picks a fragment at
+ *        random for every request, so the two usually bring different
+ *        strips.
+ *        After a failure the slot backs off for host_backoff() before its
+ *        next request. The loop gives up, and aborts the unfinished images
+ *        for every other loop, once all hosts are out of retry budget or the
+ *        deadline of the job has passed.
+ * @param int max_in_flight upper bound of the window of each image over
+ *        all loops
+ * @return 0 on success; non-zero otherwise
+ */
+int fetch_loop(IMAGE **imgs, int num_imgs, INF_POOL *inf, BUF_POOL *pool,
+               CURLSH *share, HOST_POOL *hosts, int num_transfers,
+               int max_in_flight, const FETCH_POLICY *policy)
+{
+    CURLM *cm = NULL;
+    TRANSFER *slots = NULL;
+    CURLMsg *msg = NULL;
+    int n = num_transfers;
+    int still_running = 0;
+    int msgs_left = 0;
+    int active = 0;        /* request slots in use, each holds a window place */
+    int cur = 0;           /* images before this one are full or given up on */
+    int ret = 0;
+
+    cm = curl_multi_init();
+    slots = calloc(2 * n, sizeof(TRANSFER));
+    if (cm == NULL || slots == NULL) {
+        fprintf(stderr, "fetch_loop: out of memory\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < 2 * n; i++) {
+        slots[i].host = -1;
+        recv_buf_init(&slots[i].buf, pool);
+        slots[i].eh = easy_handle_init(&slots[i].buf, share);
+        if (slots[i].eh == NULL) {
+            ret = 1;
+            goto cleanup;
+        }
+        curl_easy_setopt(slots[i].eh, CURLOPT_PRIVATE, (void *)(long)i);
+    }
+
+    while (1) {
+        double wait = POLL_MS / 1000.;
+        double t_now = now();
+        int freed = 0;     /* request slots that became idle in this pass */
+        int blocked = 0;   /* window_enter() found its image done */
+
+        while (cur < num_imgs &&
+               (strip_set_full(&imgs[cur]->strips) || image_aborted(imgs[cur]))) {
+            cur++;
+        }
+        if (cur == num_imgs) {
+            break;
+        }
+
+        if (policy->deadline > 0 && t_now >= policy->deadline) {
+            int missing = 0;
+
+            for (int k = cur; k < num_imgs; k++) {
+                missing += __atomic_load_n(&imgs[k]->strips.remaining, __ATOMIC_RELAXED);
+            }
+            fprintf(stderr, "fetch_loop: deadline passed with %d strips missing\n", missing);
+            ret = 1;
+            break;
+        }
+
+        /* keep the windows full; with nothing in flight, block for a place */
+        for (int i = 0; i < n && !blocked; i++) {
+            IMAGE *img = NULL;
+
+            if (slots[i].host >= 0 || slots[i + n].host >= 0) {
+                continue;
+            }
+            if (slots[i].not_before > t_now) {
+                if (slots[i].not_before - t_now < wait) {
+                    wait = slots[i].not_before - t_now;
+                }
+                continue;   /* backing off after a failure */
+            }
+            for (int k = cur; k < num_imgs && img == NULL; k++) {
+                if (window_try_enter(imgs[k], max_in_flight)) {
+                    img = imgs[k];
+                }
+            }
+            if (img == NULL && active == 0) {
+                /* every window is full: wait for room in the image with
+                   the fewest strips missing, it is the one nearly done */
+                int k = cur;
+
+                for (int j = cur + 1; j < num_imgs; j++) {
+                    int r = __atomic_load_n(&imgs[j]->strips.remaining, __ATOMIC_ACQUIRE);
+
+                    if (r > 0 && !image_aborted(imgs[j]) &&
+                        r < __atomic_load_n(&imgs[k]->strips.remaining, __ATOMIC_ACQUIRE)) {
+                        k = j;
+                    }
+                }
+                if (window_enter(imgs[k], max_in_flight)) {
+                    img = imgs[k];
+                } else {
+                    blocked = 1;
+                }
+            }
+            if (img == NULL) {
+                break;
+            }
+            start_transfer(cm, &slots[i], img, pool, hosts, -1, policy);
+            active++;
+        }
+        if (blocked) {
+            continue;   /* the image filled up while we waited, look again */
+        }
+
+        curl_multi_perform(cm, &still_running);
+
+        while ((msg = curl_multi_info_read(cm, &msgs_left)) != NULL) {
+            TRANSFER *t = NULL;
+            TRANSFER *other = NULL;
+            CURLcode res;
+            long i = 0;
+            int dup = 0;
+
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&i);
+            t = &slots[i];
+            other = &slots[i < n ? i + n : i - n];
+
+            res = msg->data.result;
+            dup = t->buf.dup;
+            if (res == CURLE_OK && !dup && !t->buf.drain && !request_ok(t->eh, &t->buf)) {
+                res = CURLE_HTTP_RETURNED_ERROR;
+            }
+            curl_multi_remove_handle(cm, t->eh);
+            release_request(t->eh, hosts, t->host, res, dup);
+            t->host = -1;
+            finish_request(t->img, inf, &t->buf, res);
+            recv_buf_cleanup(&t->buf);
+            window_leave(t->img);
+
+            if (other->host >= 0 && !transfer_redundant(other)) {
+                continue;   /* its twin may still bring a strip we lack */
+            }
+            if (other->host >= 0) {
+                cancel_transfer(cm, other, hosts, i >= n);
+                window_leave(other->img);
+            }
+            active--;
+            freed++;
+
+            /* the pair is done, the next request may be hedged again */
+            t = &slots[i < n ? i : i - n];
+            window_hedge_cancel(t->img, &t->hedge_waiting);
+            t->hedged = 0;
+            if (res != CURLE_OK && !dup) {
+                t->failures++;
+                t->not_before = now() + host_backoff(t->failures);
+            } else {
+                t->failures = 0;
+            }
+        }
+
+        if (host_pool_exhausted(hosts)) {
+            fprintf(stderr, "fetch_loop: every server is out of retry budget\n");
+            ret = 1;
+            break;
+        }
+
+        /* hedge requests that run past the percentile of their host, each
+           at most once and only while the window of its image has room */
+        for (int i = 0; policy->hedge_pct > 0 && hosts->num_hosts > 1 && i < n; i++) {
+            double threshold, elapsed;
+
+            if (slots[i].host < 0 || slots[i].hedged) {
+                continue;
+            }
+            threshold = host_quantile(hosts, slots[i].host, policy->hedge_pct / 100.);
+            if (threshold <= 0) {
+                continue;   /* too few samples to tell what slow is */
+            }
+            elapsed = now() - slots[i].start;
+            if (elapsed >= threshold) {
+                if (window_hedge_enter(slots[i].img, max_in_flight, &slots[i].hedge_waiting)) {
+                    start_transfer(cm, &slots[i + n], slots[i].img, pool, hosts,
+                                   host_acquire_other(hosts, slots[i].host), policy);
+                    slots[i].hedged = 1;
+                } else if (HEDGE_POLL_MS / 1000. < wait) {
+                    wait = HEDGE_POLL_MS / 1000.;   /* look again for a place */
+                }
+            } else if (threshold - elapsed < wait) {
+                wait = threshold - elapsed;
+            }
+        }
+
+        if (policy->deadline > 0 && policy->deadline - now() < wait) {
+            wait = policy->deadline - now();
+            wait = wait > 0 ? wait : 0;
+        }
+        /* refill freed slots right away instead of waiting on the others */
+        if (freed == 0) {
+            curl_multi_poll(cm, NULL, 0, (int)(wait * 1000) + 1, NULL);
+        }
+    }
+
+cleanup:
+    for (int k = cur; ret != 0 && k < num_imgs; k++) {
+        if (!strip_set_full(&imgs[k]->strips)) {
+            image_abort(imgs[k]);
+        }
+    }
+    for (int i = 0; slots != NULL && i < 2 * n; i++) {
+        if (slots[i].host >= 0) {
+            /* still in flight, abandoned now that the images are full
+               or have been given up on */
+            cancel_transfer(cm, &slots[i], hosts, 0);
+            window_leave(slots[i].img);
+        }
+        if (slots[i].hedge_waiting) {
+            window_hedge_cancel(slots[i].img, &slots[i].hedge_waiting);
+        }
+    }
+    for (int i = 0; slots != NULL && i < 2 * n; i++) {
+        if (slots[i].eh != NULL) {
+            curl_easy_cleanup(slots[i].eh);
+        }
+        recv_buf_cleanup(&slots[i].buf);
+    }
+    free(slots);
+    if (cm != NULL) {
+        curl_multi_cleanup(cm);
+    }
+    return ret;
+}
+
+/**
+ * @brief fetch thread. It runs a fetch loop with a single request slot,
+ *        so it has one request in flight at a time, plus a hedge when that
+ *        request is slow. The easy handles live as long as the thread does;
+ *        connections and DNS results are reused through the share object.
+ *        Every new strip is handed to the inflate pool as soon as it lands.
+ */
+void *do_work(void *arg){
+    struct pthread_args *args = arg;
+
+    fetch_loop(args->imgs, args->num_imgs, args->inf, args->pool, args->share,
+               args->hosts, 1, args->max_in_flight, args->policy);
+    return NULL;
+}
+
+/* State that outlives one assembly. In daemon mode it is kept warm across
+   requests: open connections and DNS results in share, latency history and
+   retry budgets in hosts, idle receive buffers in pool, the inflate
+   workers in inf and the deflate streams of the writers in def. */
+typedef struct paster_ctx {
+    const char *prog;     /* for error messages */
+    HOST_POOL hosts;
+    CURLSH *share;
+    BUF_POOL pool;
+    INF_POOL inf;
+    z_stream def[MAX_IMAGES]; /* one per writer thread, set up on first use */
+    int num_def;          /* streams of def set up so far */
+    FETCH_POLICY policy;  /* policy.deadline is set by assemble() */
+    double deadline;      /* seconds allowed per assembly, 0 for none */
+    int t;                /* fetch threads, 0 in -e mode */
+    int e;                /* transfers of the -e fetch loop, 0 for none */
+    const char *cache_dir;
+    int verbose;
+} PASTER_CTX;
+
+/**
+ * @brief fetch the images nums[0..num_imgs-1] and write image nums[k] to
+ *        paths[k]. Every image of the batch shares the connections, the
+ *        fetch threads and the inflate pool; each one is written as soon
+ *        as it is complete.
+ * @return 0 if every image was written; -1 otherwise
+ */
+int assemble(PASTER_CTX *ctx, const int *nums, int num_imgs, char (*paths)[PATH_MAX])
+{
+    IMAGE *imgs[MAX_IMAGES];
+    OUTPUT_JOB jobs[MAX_IMAGES];
+    FETCH_POLICY policy = ctx->policy;
+    int t = ctx->t;
+    int e = ctx->e;
+    int ret = 0;
+
+    for (; ctx->num_def < num_imgs; ctx->num_def++) {
+        z_stream *strm = &ctx->def[ctx->num_def];
+
+        strm->zalloc = Z_NULL;
+        strm->zfree = Z_NULL;
+        strm->opaque = Z_NULL;
+        if (deflateInit(strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            fprintf(stderr, "%s: deflateInit failed\n", ctx->prog);
+            return -1;
+        }
+    }
+    if (ctx->deadline > 0) {
+        policy.deadline = now() + ctx->deadline;
+    }
+    for (int k = 0; k < num_imgs; k++) {
+        imgs[k] = malloc(sizeof(IMAGE));
+        image_init(imgs[k], nums[k], &ctx->pool);
+        jobs[k].img = imgs[k];
+        jobs[k].def = &ctx->def[k];
+        jobs[k].ret = 0;
+        snprintf(jobs[k].path, PATH_MAX, "%s", paths[k]);
+    }
+
+    /* only the strips missing from the cache go to the network */
+    if (ctx->cache_dir != NULL) {
+        int cached = 0;
+
+        for (int k = 0; k < num_imgs; k++) {
+            imgs[k]->cache_dir = ctx->cache_dir;
+            cached += image_load_cache(imgs[k], &ctx->inf);
+        }
+        if (cached == num_imgs * NUM_STRIPS) {
+            t = 0;
+            e = 0;
+        }
+    }
+
+    pthread_t *p_tids = malloc(sizeof(pthread_t) * (t + 1));
+    struct pthread_args *array_of_args = malloc(sizeof(struct pthread_args) * (t + 1));
+
+    for (int k = 0; k < num_imgs; k++) {
+        pthread_create(&jobs[k].tid, NULL, write_image, &jobs[k]);
+    }
+    for (int i = 0; i < t; i++) {
+        array_of_args[i].imgs = imgs;
+        array_of_args[i].num_imgs = num_imgs;
+        array_of_args[i].inf = &ctx->inf;
+        array_of_args[i].pool = &ctx->pool;
+        array_of_args[i].share = ctx->share;
+        array_of_args[i].hosts = &ctx->hosts;
+        array_of_args[i].max_in_flight = t;
+        array_of_args[i].policy = &policy;
+        pthread_create(p_tids + i, NULL, do_work, array_of_args + i); 
+
+    }
+    if (e > 0) {
+        fetch_loop(imgs, num_imgs, &ctx->inf, &ctx->pool, ctx->share, &ctx->hosts, e, e, &policy);
+    }
+
+    for (int i = 0; i < t; i++) {
+        pthread_join(p_tids[i], NULL);
+    }
+    for (int k = 0; k < num_imgs; k++) {
+        pthread_join(jobs[k].tid, NULL);
+    }
+    free(array_of_args);
+    free(p_tids);
+    if (ctx->verbose) {
+        long requests = 0, dup_count = 0, dup_bytes = 0;
+        int cached = 0;
+
+        for (int k = 0; k < num_imgs; k++) {
+            requests += imgs[k]->requests;
+            dup_count += imgs[k]->dup_count;
+            dup_bytes += imgs[k]->dup_bytes;
+            cached += imgs[k]->cached;
+        }
+        host_pool_report(&ctx->hosts, stderr);
+        fprintf(stderr, "%ld requests, %ld duplicates, %ld duplicate body bytes\n",
+                requests, dup_count, dup_bytes);
+        if (ctx->cache_dir != NULL) {
+            fprintf(stderr, "%d of %d strips from %s\n", cached, num_imgs * NUM_STRIPS, ctx->cache_dir);
+        }
+    }
+
+    for (int k = 0; k < num_imgs; k++) {
+        IMAGE *img = imgs[k];
+
+        if (img->error || image_aborted(img)) {
+            fprintf(stderr, "%s: failed to %s image %d\n", ctx->prog,
+                    img->error ? "decode" : "fetch", img->img_number);
+            ret = -1;
+        } else if (jobs[k].ret != 0) {
+            fprintf(stderr, "%s: failed to write %s\n", ctx->prog, jobs[k].path);
+            ret = -1;
+        }
+        image_cleanup(img);
+        free(img);
+    }
+    return ret;
+}
+
+static volatile sig_atomic_t stop_serving = 0;
+
+void stop_handler(int sig)
+{
+    stop_serving = 1;
+}
+
+/**
+ * @brief daemon mode: accept assembly requests on the Unix socket at
+ *        sock_path, one at a time, until SIGINT or SIGTERM. A request is a
+ *        single line "N PATH", asking for image N to be written to PATH,
+ *        and is answered with "OK" or "ERR" and a reason on one line.
+ *        Only the user running the daemon may send requests.
+ *        See paster_client.c.
+ * @return 0 on a clean shutdown; non-zero if the socket cannot be set up
+ */
+int serve(PASTER_CTX *ctx, const char *sock_path)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    mode_t old_mask;
+    int fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long -- 'D'\n", ctx->prog);
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    if (lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(sock_path);   /* left behind by a daemon that was killed */
+    }
+    /* requests write files as this user, so only this user may connect */
+    old_mask = umask(077);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        perror(sock_path);
+        umask(old_mask);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    umask(old_mask);
+
+    /* no SA_RESTART, so that accept() returns once a signal arrives */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stop_serving) {
+        char line[REQ_LINE_MAX];
+        char paths[1][PATH_MAX];
+        char reply[64];
+        size_t len = 0;
+        int nums[MAX_IMAGES];
+        int conn = accept(fd, NULL, NULL);
+        char *space = NULL;
+        double start = now();
+        int expired = 0;
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+
+        if (conn < 0) {
+            continue;
+        }
+        /* the socket mode can be changed, the peer's user cannot */
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+            cred.uid != geteuid()) {
+            fprintf(stderr, "%s: request from another user refused\n", ctx->prog);
+            close(conn);
+            continue;
+        }
+        /* one slow client must not hold up the daemon for the others */
+        while (len < sizeof(line) - 1) {
+            struct pollfd pfd = { conn, POLLIN, 0 };
+            int left = REQ_TIMEOUT_MS - (int)((now() - start) * 1000);
+            ssize_t r;
+
+            if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+                expired = 1;
+                break;
+            }
+            r = read(conn, line + len, sizeof(line) - 1 - len);
+            if (r <= 0) {
+                break;
+            }
+            len += r;
+            if (memchr(line + len - r, '\n', r) != NULL) {
+                break;
+            }
+        }
+        if (expired) {
+            fprintf(stderr, "%s: no request within %d ms, dropped\n", ctx->prog, REQ_TIMEOUT_MS);
+            close(conn);
+            continue;
+        }
+        line[len] = '\0';
+        line[strcspn(line, "\n")] = '\0';
+        space = strchr(line, ' ');
+
+        if (space == NULL || space[1] == '\0' || strlen(space + 1) >= PATH_MAX) {
+            snprintf(reply, sizeof(reply), "ERR bad request\n");
+        } else {
+            *space = '\0';
+            if (parse_image_list(line, nums) != 1) {
+                snprintf(reply, sizeof(reply), "ERR bad image number\n");
+            } else {
+                strcpy(paths[0], space + 1);
+                /* a dead spell before this request must not fail it too */
+                if (host_pool_exhausted(&ctx->hosts)) {
+                    host_pool_refill(&ctx->hosts);
+                }
+                if (assemble(ctx, nums, 1, paths) == 0) {
+                    snprintf(reply, sizeof(reply), "OK %.3f seconds\n", now() - start);
+                } else {
+                    snprintf(reply, sizeof(reply), "ERR failed to assemble image %d\n", nums[0]);
+                }
+            }
+        }
+        if (write(conn, reply, strlen(reply)) < 0) {
+            perror("write");
+        }
+        close(conn);
+    }
+
+    close(fd);
+    unlink(sock_path);
+    return 0;
+}
+
+int main( int argc, char** argv ) 
+{
+    int c;
+    int t = 1;
+    int nums[MAX_IMAGES] = { 1 };
+    int num_imgs = 1;
+    int w = 2;
+    int e = 0;
+    int verbose = 0;
+    FETCH_POLICY policy = { HEDGE_PCT, 0, 0 };
+    double deadline = 0;
+    char *host_list = ECE252_HOSTS;
+    char *cache_dir = NULL;
+    char *sock_path = NULL;
+    char *str = "option requires an argument";
+    
+    while ((c = getopt (argc, argv, "t:n:w:e:s:vH:d:c:D:i")) != -1) {
+        switch (c) {
+        case 't':
+	    t = strtoul(optarg, NULL, 10);
+	    //printf("option -t specifies a value of %d.\n", t);
+	    if (t <= 0) {
+                fprintf(stderr, "%s: %s > 0 -- 't'\n", argv[0], str);
+                return -1;
+            }
+            break;
+        case 'n':
+            num_imgs = parse_image_list(optarg, nums);
+            if (num_imgs <= 0) {
+                fprintf(stderr, "%s: %s 1, 2, or 3, or a list of them such as 1,2,3 -- 'n'\n",
+                        argv[0], str);
+                return -1;
+            }
+            break;
+        case 'w':
+            w = strtoul(optarg, NULL, 10);
+            if (w <= 0) {
+                fprintf(stderr, "%s: %s > 0 -- 'w'\n", argv[0], str);
+                return -1;
+            }
+            break;
+        case 'e':
+            e = strtoul(optarg, NULL, 10);
+            if (e <= 0) {
+                fprintf(stderr, "%s: %s > 0 -- 'e'\n", argv[0], str);
+                return -1;
+            }
+            break;
+        case 's':
+            host_list = optarg;   /* comma separated host[:port] list */
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'H':
+            policy.hedge_pct = strtoul(optarg, NULL, 10);
+            if (policy.hedge_pct < 0 || policy.hedge_pct >= 100) {
+                fprintf(stderr, "%s: %s 0 (off) to 99 -- 'H'\n", argv[0], str);
+                return -1;
+            }
+            break;
+        case 'd':
+            deadline = strtod(optarg, NULL);   /* seconds for the whole job */
+            if (deadline <= 0) {
+                fprintf(stderr, "%s: %s > 0 -- 'd'\n", argv[0], str);
+                return -1;
+            }
+            break;
+        case 'c':
+            cache_dir = optarg;   /* fragment cache shared between runs */
+            if (frag_cache_init(cache_dir) != 0) {
+                return -1;
+            }
+            break;
+        case 'D':
+            sock_path = optarg;   /* run as a daemon, see serve() */
+            break;
+        case 'i':
+            policy.stream = 1;    /* inflate while receiving, see stream_write() */
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (policy.stream && cache_dir != NULL) {
+        /* a streamed fragment is never held in memory, so it cannot be cached */
+        fprintf(stderr, "%s: -i and -c cannot be used together\n", argv[0]);
+        return -1;
+    }
+
+    PASTER_CTX ctx;
+    ctx.prog = argv[0];
+    ctx.policy = policy;
+    ctx.deadline = deadline;
+    /* -e N: one thread drives N transfers instead of -t blocking threads */
+    ctx.t = e > 0 ? 0 : t;
+    ctx.e = e;
+    ctx.cache_dir = cache_dir;
+    ctx.verbose = verbose;
+    ctx.num_def = 0;
+    if (host_pool_init(&ctx.hosts, host_list, ECE252_PORT, 0) != 0) {
+        fprintf(stderr, "%s: invalid server list -- 's'\n", argv[0]);
+        return -1;
+    }
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    ctx.share = share_init();
+    if (ctx.share == NULL) {
+        curl_global_cleanup();
+        return -1;
+    }
+    buf_pool_init(&ctx.pool);
+    if (inf_pool_init(&ctx.inf, w) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    if (sock_path != NULL) {
+        ret = serve(&ctx, sock_path);
+    } else {
+        char paths[MAX_IMAGES][PATH_MAX];
+
+        for (int k = 0; k < num_imgs; k++) {
+            if (num_imgs == 1) {
+                strcpy(paths[k], "all.png");
+            } else {
+                snprintf(paths[k], PATH_MAX, "all_%d.png", nums[k]);
+            }
+        }
+        ret = assemble(&ctx, nums, num_imgs, paths);
+    }
+
+    inf_pool_shutdown(&ctx.inf);
+    share_cleanup(ctx.share);
+    curl_global_cleanup();
+    host_pool_destroy(&ctx.hosts);
+    buf_pool_destroy(&ctx.pool);
+    for (int k = 0; k < ctx.num_def; k++) {
+        (void) deflateEnd(&ctx.def[k]);
+    }
+    return ret;
+}
@@ -0,0 +1,102 @@
+/**
+ * @file paster_client.c
+ * @brief thin client of a paster daemon (paster -D SOCKET). It asks the
+ *        daemon for one image and waits for it to be written, so a request
+ *        costs the fetch and the encode and none of the start-up work.
+ *
+ * Usage: paster_client [-D SOCKET] [-n N] [OUTPUT]
+ *
+ *   -D  Unix socket the daemon listens on. Default /tmp/paster.sock
+ *   -n  image number, 1, 2 or 3. Default 1
+ *   OUTPUT  where the daemon writes the PNG. Default all.png. A relative
+ *       path is taken relative to the client's working directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>     /* for PATH_MAX               */
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>     /* for struct sockaddr_un     */
+
+#define PASTER_SOCKET "/tmp/paster.sock"
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char *sock_path = PASTER_SOCKET;
+    char *out = "all.png";
+    char path[PATH_MAX];
+    char req[PATH_MAX + 16];
+    char reply[256];
+    ssize_t len = 0;
+    int n = 1;
+    int c, fd;
+
+    while ((c = getopt(argc, argv, "D:n:")) != -1) {
+        switch (c) {
+        case 'D':
+            sock_path = optarg;
+            break;
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            if (n <= 0 || n > 3) {
+                fprintf(stderr, "%s: option requires an argument 1, 2, or 3 -- 'n'\n", argv[0]);
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-D SOCKET] [-n N] [OUTPUT]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (optind < argc) {
+        out = argv[optind];
+    }
+
+    /* the daemon has a working directory of its own */
+    if (out[0] == '/') {
+        snprintf(path, sizeof(path), "%s", out);
+    } else if (getcwd(path, sizeof(path)) == NULL ||
+               strlen(path) + 1 + strlen(out) >= sizeof(path)) {
+        fprintf(stderr, "%s: output path too long\n", argv[0]);
+        return -1;
+    } else {
+        strcat(path, "/");
+        strcat(path, out);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(sock_path);
+        return -1;
+    }
+
+    snprintf(req, sizeof(req), "%d %s\n", n, path);
+    if (write(fd, req, strlen(req)) != (ssize_t)strlen(req)) {
+        perror("write");
+        close(fd);
+        return -1;
+    }
+    while (len < (ssize_t)sizeof(reply) - 1) {
+        ssize_t r = read(fd, reply + len, sizeof(reply) - 1 - len);
+
+        if (r <= 0) {
+            break;
+        }
+        len += r;
+    }
+    close(fd);
+    reply[len] = '\0';
+
+    if (strncmp(reply, "OK", 2) != 0) {
+        fprintf(stderr, "%s: %s", argv[0], len > 0 ? reply : "no reply from the daemon\n");
+        return -1;
+    }
+    return 0;
+}
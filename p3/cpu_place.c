@@ -0,0 +1,186 @@
+/**
+ * @file: cpu_place.c
+ * @brief: CPU sets, NUMA nodes and memory policy
+ */
+
+#define _GNU_SOURCE   /* for cpu_set_t */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "cpu_place.h"
+
+#define COUNT_CHUNK 256   /* pages asked about per move_pages() call */
+
+/**
+ * @brief read a CPU list such as "0-3,8" into set
+ * @return 0 on success; non-zero if list is malformed or names no CPU
+ */
+int cpuset_parse(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+
+    CPU_ZERO(set);
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0) {
+            return 1;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return 1;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return 1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return 1;
+        }
+    }
+    return CPU_COUNT(set) == 0;
+}
+
+/**
+ * @brief write set into buf as a CPU list, the way cpuset_parse() reads it
+ */
+void cpuset_format(const cpu_set_t *set, char *buf, size_t len)
+{
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && used < len; cpu++) {
+        int last = cpu;
+
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        if (last == cpu) {
+            used += snprintf(buf + used, len - used, "%s%d", used ? "," : "", cpu);
+        } else {
+            used += snprintf(buf + used, len - used, "%s%d-%d", used ? "," : "", cpu, last);
+        }
+        cpu = last;
+    }
+}
+
+/**
+ * @return the mask of the NUMA nodes that have a CPU of set. A system
+ *         without node information in sysfs is taken to be node 0 alone.
+ */
+unsigned long cpuset_nodes(const cpu_set_t *set)
+{
+    unsigned long nodes = 0;
+    int found = 0;
+
+    for (int node = 0; node < PLACE_MAX_NODES; node++) {
+        char path[64];
+        char list[1024];
+        cpu_set_t cpus;
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        found = 1;
+        if (fgets(list, sizeof(list), fp) != NULL && cpuset_parse(list, &cpus) == 0) {
+            CPU_AND(&cpus, &cpus, set);
+            if (CPU_COUNT(&cpus) > 0) {
+                nodes |= 1UL << node;
+            }
+        }
+        fclose(fp);
+    }
+    return found ? nodes : 1;
+}
+
+/**
+ * @brief write the nodes of mask nodes into buf as a list
+ */
+void nodemask_format(unsigned long nodes, char *buf, size_t len)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for (int node = 0; node < PLACE_MAX_NODES; node++) {
+        if (nodes & (1UL << node)) {
+            CPU_SET(node, &set);
+        }
+    }
+    cpuset_format(&set, buf, len);
+}
+
+/**
+ * @brief ask for the pages of [addr, addr + len) to be put on nodes: on the
+ *        one node if there is one, spread over them if there are several.
+ *        Pages already in memory stay where they are, so this is to be
+ *        called before the range is first touched. One node is only
+ *        preferred (MPOL_PREFERRED), so a full node does not make a fault
+ *        fail. Several are interleaved (MPOL_INTERLEAVE), which also falls
+ *        back to other nodes once every one of them is full. The range is
+ *        widened to whole pages of page bytes, the size of the pages that
+ *        back it.
+ * @return 0 on success; -1 with errno set otherwise
+ */
+int place_bind(void *addr, size_t len, size_t page, unsigned long nodes)
+{
+    unsigned long start = (unsigned long)addr / page * page;
+    unsigned long end = ((unsigned long)addr + len + page - 1) / page * page;
+    int mode = __builtin_popcountl(nodes) == 1 ? MPOL_PREFERRED : MPOL_INTERLEAVE;
+
+    /* the kernel reads one bit fewer than maxnode says */
+    return syscall(SYS_mbind, start, end - start, mode, &nodes, PLACE_MAX_NODES + 1, 0) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief add up on which node each page of [addr, addr + len) is, in
+ *        count[node], page being the size of the pages that back it.
+ *        Pages not in memory are not counted.
+ * @return the number of pages counted; -1 with errno set on failure
+ */
+int place_count(void *addr, size_t len, size_t page, int count[PLACE_MAX_NODES])
+{
+    char *start = (char *)((unsigned long)addr / page * page);
+    char *end = (char *)addr + len;
+    int counted = 0;
+
+    memset(count, 0, PLACE_MAX_NODES * sizeof(int));
+    while (start < end) {
+        void *pages[COUNT_CHUNK];
+        int status[COUNT_CHUNK];
+        int n = 0;
+
+        for (; n < COUNT_CHUNK && start < end; n++, start += page) {
+            pages[n] = start;
+        }
+        /* with no target nodes move_pages() only reports where pages are */
+        if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) != 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (status[i] >= 0 && status[i] < PLACE_MAX_NODES) {
+                count[status[i]]++;
+                counted++;
+            }
+        }
+    }
+    return counted;
+}
@@ -0,0 +1,25 @@
+/**
+ * @file: cpu_place.h
+ * @brief: where the processes of a run execute and where their shared
+ *         memory lives. CPU sets are written as in taskset -c, "0-3,8",
+ *         and the NUMA nodes of a set come from sysfs. Memory policy is set
+ *         with the mbind() and move_pages() system calls directly so that
+ *         libnuma is not needed; on a kernel without NUMA they fail and
+ *         placement falls back to the kernel's choice.
+ */
+
+#pragma once
+
+#include <sched.h>    /* cpu_set_t, with _GNU_SOURCE defined by the includer */
+#include <stddef.h>
+
+/* DEFINES */
+#define PLACE_MAX_NODES 64  /* nodes a node mask can hold */
+
+/* FUNCTION PROTOTYPES */
+int cpuset_parse(const char *list, cpu_set_t *set);
+void cpuset_format(const cpu_set_t *set, char *buf, size_t len);
+unsigned long cpuset_nodes(const cpu_set_t *set);
+void nodemask_format(unsigned long nodes, char *buf, size_t len);
+int place_bind(void *addr, size_t len, size_t page, unsigned long nodes);
+int place_count(void *addr, size_t len, size_t page, int count[PLACE_MAX_NODES]);
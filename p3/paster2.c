@@ -21,58 +21,132 @@
  * @see https://curl.haxx.se/libcurl/c/getinmemory.html
  * @see https://curl.haxx.se/libcurl/using/
  * @see https://ec.haxx.se/callback-write.html
- * NOTE: we assume each image segment from the server is less than 10K
+ * NOTE: every fragment but the last is assumed to be as tall as the first
  */ 
 
 
+#define _GNU_SOURCE   /* for sched_setaffinity() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <curl/curl.h>
-#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
-#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 //#include "shm_stack.h"
 
 
 #include <errno.h>    /* for errno                   */
+#include <arpa/inet.h> /* for ntohl() and htonl()    */
 #include "crc.h"      /* for crc()                   */
 #include "zutil.h"    /* for mem_def() and mem_inf() */
 #include "lab_png.h"  /* simple PNG data structures  */
 #include <sys/queue.h>
 #include <curl/curl.h>
 #include <sys/types.h>
+#include <getopt.h>
+#include <time.h>
+#include "host_pool.h" /* for host_acquire() and friends */
+#include "frag_cache.h" /* for frag_cache_get()           */
+#include "shm_ring.h"  /* for shm_ring_push()            */
+#include "shm_arena.h" /* for shm_arena_create()         */
+#include "cpu_place.h" /* for cpuset_parse()               */
+#include <pthread.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 
 
 #define IMG_URL "http://ece252-1.uwaterloo.ca:2530/image?img=1&part=20"
 #define DUM_URL "https://example.com/"
 #define ECE252_HEADER "X-Ece252-Fragment: "
-#define BUF_SIZE 10240 /* 1024*10 = 10K */
-
-/* This is a flattened structure, buf points to 
+#define ECE252_COUNT_HEADER "X-Ece252-Fragment-Count: "
+#define ECE252_FRAGS 50 /* fragments per image when the server does not say */
+#define MAX_HEIGHT 65536 /* rows of the tallest image taken, which also bounds
+                            the fragment count a server or the cache gives */
+#define META_BUF_SIZE 1048576 /* receive buffer of the fragments fetched
+                                 before the geometry of the image is known */
+#define PNG_OVERHEAD 57 /* bytes of a fragment around its zlib data: the
+                           signature and the IHDR, IDAT and IEND chunks */
+#define ECE252_HOSTS "ece252-1.uwaterloo.ca,ece252-2.uwaterloo.ca,ece252-3.uwaterloo.ca"
+#define ECE252_PORT 2530
+#define HEDGE_PCT 90   /* default latency percentile that triggers a hedge */
+#define POLL_MS 1000   /* longest wait in curl_multi_poll() */
+#define IDAT_MAX 65536 /* zlib bytes in one IDAT chunk of all.png */
+#define CONS_BATCH 4   /* default most fragments a consumer takes at once */
+#define SAMPLE_MS 20   /* how often the autoscaling supervisor looks */
+#define SAMPLE_WEIGHT 0.3 /* weight of the newest sample of time per fragment */
+#define OPT_PROD_CPUS 256 /* getopt_long() values of the options without a letter */
+#define OPT_CONS_CPUS 257
+
+/* Workers 0 to active - 1 of a pool run, the others are parked on gate.
+   Each worker also adds up the time it spends on fragments, so the
+   supervisor can tell which side of the pipeline is the slow one. */
+typedef struct worker_pool {
+    int active __attribute__((aligned(ARENA_LINE)));
+                         /* workers allowed to run                  */
+    unsigned int gate;   /* futex word, bumped when active changes  */
+    long busy_ns __attribute__((aligned(ARENA_LINE)));
+                         /* time spent on fragments in nanoseconds  */
+    long done;           /* fragments that time was spent on        */
+} WORKER_POOL;
+
+/* Counters and flags shared by every process of a run. They sit in their
+   own region at the start of the arena and are only touched with atomic
+   instructions. Each has a cache line to itself, so a producer claiming a
+   fragment does not steal the line a consumer is counting on. */
+typedef struct paster_ctl {
+    int prod_count __attribute__((aligned(ARENA_LINE)));
+                         /* next fragment for a producer to get     */
+    int total_height __attribute__((aligned(ARENA_LINE)));
+                         /* rows inflated so far                    */
+    int width __attribute__((aligned(ARENA_LINE)));
+                         /* of the image in pixels, 0 until known   */
+    int aborted __attribute__((aligned(ARENA_LINE)));
+                         /* set when a worker gives up on the image */
+    WORKER_POOL prod;    /* the producers                           */
+    WORKER_POOL cons;    /* the consumers                           */
+} PASTER_CTL;
+
+/* Sizes the worker pools from inside main while the image is pasted */
+typedef struct supervisor {
+    PASTER_CTL *ctl;
+    SHM_RING *strips;    /* the ring between producers and consumers */
+    int max_prod;        /* most producers and consumers to run      */
+    int max_cons;
+    int verbose;         /* report every change on stderr            */
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled when stop is set               */
+    int stop;
+} SUPERVISOR;
+
+/* When producers hedge, retry and give up */
+typedef struct fetch_policy {
+    int hedge_pct;   /* latency percentile that triggers a hedge, 0 for none */
+    double deadline; /* now() by which the whole job must be done, 0 for none */
+} FETCH_POLICY;
+
+/* This is a flattened structure, buf is 
    the memory address immediately after 
-   the last member field (i.e. seq) in the structure.
+   the last member field (i.e. num_frags) in the structure.
    Here is the memory layout. 
    Note that the memory is a chunk of continuous bytes.
 
    On a 64-bit machine, the memory layout is as follows:
 
    +================+
-   | buf            | 8 bytes
-   +----------------+
    | size           | 8 bytes
    +----------------+
    | max_size       | 8 bytes
    +----------------+
    | seq            | 4 bytes
    +----------------+
-   | padding        | 4 bytes
+   | num_frags      | 4 bytes
    +----------------+
    | buf[0]         | 1 byte
    +----------------+
@@ -84,18 +158,49 @@
    +================+
 */
 typedef struct recv_buf_flat {
-    U8 buf[10000];       /* memory to hold a copy of received data */
     size_t size;     /* size of valid data in buf in bytes*/
     size_t max_size; /* max capacity of buf in bytes*/
     int seq;         /* >=0 sequence number extracted from http header */
                      /* <0 indicates an invalid seq number */
+    int num_frags;   /* fragments in the image, 0 if the server did not say */
+    U8 buf[];        /* memory to hold a copy of received data */
 } RECV_BUF;
 
+/* The curl handles of a process, made once and kept for as long as it
+   runs. The multi handle holds the connection cache, so a request goes
+   out on the connection an earlier one left open to the same server. */
+typedef struct fetcher {
+    CURLM *cm;
+    CURL *eh[2];         /* the request and its hedge      */
+    RECV_BUF *hedge_buf; /* receive buffer of the hedge    */
+    size_t hedge_max;    /* bytes hedge_buf->buf can hold  */
+} FETCHER;
+
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
 //int recv_buf_init(RECV_BUF *ptr, size_t max_size);
 int recv_buf_cleanup(RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
+CURL *easy_handle_init(void);
+int fetcher_init(FETCHER *f);
+void fetcher_cleanup(FETCHER *f);
+CURLcode fetch_attempt(FETCHER *f, HOST_POOL *hosts, int img_number, int part, RECV_BUF *p_recv_buf, const FETCH_POLICY *policy);
+CURLcode fetch_part(FETCHER *f, HOST_POOL *hosts, int img_number, int part, RECV_BUF *p_recv_buf, const FETCH_POLICY *policy);
+CURLcode get_part(FETCHER *f, HOST_POOL *hosts, const char *cache_dir, int img_number, int part, RECV_BUF *p_recv_buf, const FETCH_POLICY *policy);
+int strip_geometry(const RECV_BUF *p, U32 *p_width, U32 *p_height);
+RECV_BUF *slab_slot(char *slab, size_t slot_size, U32 k);
+int write_chunk(FILE *fp, U8 *buf, U32 len);
+int write_ihdr(FILE *fp, U32 width, U32 height);
+int deflate_strips(FILE *fp, SHM_RING *done_strips, U8 *raw, int num_strips,
+                   size_t strip_raw, size_t raw_size);
+void pool_park(WORKER_POOL *pool, int i);
+void pool_resize(WORKER_POOL *pool, int n);
+void pool_account(WORKER_POOL *pool, double seconds, int n);
+void stop_workers(PASTER_CTL *ctl, SHM_RING **rings, int num_rings,
+                  const pid_t *prod, int num_prod, const pid_t *cons, int num_cons);
+void *supervise(void *arg);
+void report_cpus(const char *who, const cpu_set_t *set);
+void report_pages(const char *name, void *addr, size_t len, size_t page);
 
 
 /**
@@ -110,7 +215,8 @@ int write_file(const char *path, const void *in, size_t len);
  * @details this routine will be invoked multiple times by the libcurl until the full
  * header data are received.  we are only interested in the ECE252_HEADER line 
  * received so that we can extract the image sequence number from it. This
- * explains the if block in the code.
+ * explains the if block in the code. A server may also say how many
+ * fragments the image has in an X-Ece252-Fragment-Count line.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
 {
@@ -123,6 +229,16 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
         /* extract img sequence number */
 	p->seq = atoi(p_recv + strlen(ECE252_HEADER));
 
+    } else if (realsize > strlen(ECE252_COUNT_HEADER) &&
+               strncmp(p_recv, ECE252_COUNT_HEADER, strlen(ECE252_COUNT_HEADER)) == 0) {
+        const char *count = p_recv + strlen(ECE252_COUNT_HEADER);
+        char *end = NULL;
+        long n;
+
+        /* a count out of range is taken as no count at all */
+        errno = 0;
+        n = strtol(count, &end, 10);
+        p->num_frags = end != count && errno == 0 && n >= 1 && n <= MAX_HEIGHT ? n : 0;
     }
     return realsize;
 }
@@ -145,7 +261,7 @@ size_t write_cb_curl(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
  
     if (p->size + realsize + 1 > p->max_size) {/* hope this rarely happens */ 
         fprintf(stderr, "User buffer is too small, abort...\n");
-        abort();
+        return 0;   /* curl fails the transfer with CURLE_WRITE_ERROR */
     }
 
     memcpy(p->buf + p->size, p_recv, realsize); /*copy data from libcurl*/
@@ -181,6 +297,7 @@ int recv_buf_init(RECV_BUF *ptr, size_t max_size)
     ptr->size = 0;
     ptr->max_size = max_size;
     ptr->seq = -1;              /* valid seq should be non-negative */
+    ptr->num_frags = 0;
     return 0;
 }
 
@@ -190,7 +307,7 @@ int recv_buf_cleanup(RECV_BUF *ptr)
 	return 1;
     }
     
-    free(ptr->buf);
+    /* buf is part of the structure, there is nothing to free */
     ptr->size = 0;
     ptr->max_size = 0;
     return 0;
@@ -231,255 +348,737 @@ int write_file(const char *path, const void *in, size_t len)
     return fclose(fp);
 }
 
-
-typedef struct buf_stack
-{
-    int size;               /* the max capacity of the stack */
-    int pos;                /* position of last item pushed onto the stack */
-    RECV_BUF *items;             /* stack of stored buffers */
-} ISTACK;
-
 /**
- * @brief calculate the total memory that the struct int_stack needs and
- *        the items[size] needs.
- * @param int size maximum number of integers the stack can hold
- * @return return the sum of ISTACK size and the size of the data that
- *         items points to.
+ * @brief create an easy handle with the options that stay the same for
+ *        every request it makes
+ * @return NULL on failure
+ * NOTE: the URL and receive buffer are set per request, see fetch_attempt()
  */
-
-int sizeof_shm_stack(int size)
+CURL *easy_handle_init(void)
 {
-    return (sizeof(ISTACK) + sizeof(RECV_BUF) * size);
+    CURL *curl_handle = curl_easy_init();
+
+    if (curl_handle == NULL) {
+        fprintf(stderr, "curl_easy_init: returned NULL\n");
+        return NULL;
+    }
+
+    /* register write call back function to process received data */
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl); 
+
+    /* register header call back function to process received header data */
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl); 
+
+    /* some servers requires a user-agent field */
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+    return curl_handle;
 }
 
 /**
- * @brief initialize the ISTACK member fields.
- * @param ISTACK *p points to the starting addr. of an ISTACK struct
- * @param int stack_size max. number of items the stack can hold
- * @return 0 on success; non-zero on failure
- * NOTE:
- * The caller first calls sizeof_shm_stack() to allocate enough memory;
- * then calls the init_shm_stack to initialize the struct
+ * @brief make the curl handles of a process. The hedge buffer is allocated
+ *        by fetch_attempt() once it knows how large fragments get.
+ * @return 0 on success; non-zero otherwise, with nothing left to clean up
  */
-int init_shm_stack(ISTACK *p, int stack_size)
+int fetcher_init(FETCHER *f)
 {
-    if ( p == NULL || stack_size == 0 ) {
+    f->cm = curl_multi_init();
+    f->eh[0] = easy_handle_init();
+    f->eh[1] = easy_handle_init();
+    f->hedge_buf = NULL;
+    f->hedge_max = 0;
+    if (f->cm == NULL || f->eh[0] == NULL || f->eh[1] == NULL) {
+        fetcher_cleanup(f);
         return 1;
     }
-
-    p->size = stack_size;
-    p->pos  = -1;
-    p->items = (RECV_BUF *) ((char *)p + sizeof(ISTACK));
     return 0;
 }
 
 /**
- * @brief create a stack to hold size number of integers and its associated
- *      ISTACK data structure. Put everything in one continous chunk of memory.
- * @param int size maximum number of integers the stack can hold
- * @return NULL if size is 0 or malloc fails
+ * @brief release the curl handles of f and the connections they hold
  */
+void fetcher_cleanup(FETCHER *f)
+{
+    for (int i = 0; i < 2; i++) {
+        if (f->eh[i] != NULL) {
+            curl_easy_cleanup(f->eh[i]);
+            f->eh[i] = NULL;
+        }
+    }
+    if (f->cm != NULL) {
+        curl_multi_cleanup(f->cm);
+        f->cm = NULL;
+    }
+    free(f->hedge_buf);
+    f->hedge_buf = NULL;
+    f->hedge_max = 0;
+}
 
-ISTACK *create_stack(int size)
+/**
+ * @return seconds on a monotonic clock
+ */
+double now(void)
 {
-    int mem_size = 0;
-    ISTACK *pstack = NULL;
-    
-    if ( size == 0 ) {
-        return NULL;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+/**
+ * @brief fetch fragment part of image img_number into p_recv_buf from the
+ *        host picked by host_acquire(), with the handles of f. If the
+ *        answer takes longer than the hedge_pct latency percentile of that
+ *        host, the same request is sent to another host; the first of the
+ *        two to finish wins and the other is cancelled. Each request is
+ *        given up after host_timeout(), or at the deadline of the job if
+ *        that comes first.
+ * @return CURLE_OK on success
+ */
+CURLcode fetch_attempt(FETCHER *f, HOST_POOL *hosts, int img_number, int part, RECV_BUF *p_recv_buf, const FETCH_POLICY *policy)
+{
+    CURLM *cm = f->cm;
+    CURL **eh = f->eh;               /* the request and its hedge */
+    RECV_BUF *bufs[2] = { p_recv_buf, NULL };
+    int host[2] = { -1, -1 };        /* host of each request, -1 when done */
+    double start[2] = { 0, 0 };
+    CURLcode res = CURLE_FAILED_INIT;
+    CURLMsg *msg = NULL;
+    int still_running = 0;
+    int msgs_left = 0;
+    int next = 0;                    /* request to send next, -1 for none */
+    int hedged = 0;
+    int winner = -1;
+    size_t max_size = p_recv_buf->max_size;
+    char url[256];
+
+    if (f->hedge_max < max_size) {
+        RECV_BUF *grown = realloc(f->hedge_buf, sizeof(RECV_BUF) + max_size);
+
+        if (grown == NULL) {
+            return CURLE_OUT_OF_MEMORY;
+        }
+        f->hedge_buf = grown;
+        f->hedge_max = max_size;
     }
+    bufs[1] = f->hedge_buf;
 
-    mem_size = sizeof_shm_stack(size);
-    pstack = malloc(mem_size);
+    while (winner < 0) {
+        double wait = POLL_MS / 1000.;
 
-    if ( pstack == NULL ) {
-        perror("malloc");
-    } else {
-        char *p = (char *)pstack;
-        pstack->items = (RECV_BUF *) (p + sizeof(ISTACK));
-        pstack->size = size;
-        pstack->pos  = -1;
+        if (next >= 0) {
+            int i = next;
+
+            next = -1;
+            recv_buf_init(bufs[i], max_size);
+            host[i] = i == 0 ? host_acquire(hosts) : host_acquire_other(hosts, host[0]);
+            sprintf(url, "%s/image?img=%d&part=%d", host_url(hosts, host[i]), img_number, part);
+            double timeout = host_timeout(hosts, host[i]);
+
+            start[i] = now();
+            if (policy->deadline > 0 && policy->deadline - start[i] < timeout) {
+                timeout = policy->deadline - start[i];
+            }
+            curl_easy_setopt(eh[i], CURLOPT_URL, url);
+            curl_easy_setopt(eh[i], CURLOPT_WRITEDATA, (void *)bufs[i]);
+            curl_easy_setopt(eh[i], CURLOPT_HEADERDATA, (void *)bufs[i]);
+            curl_easy_setopt(eh[i], CURLOPT_TIMEOUT_MS, (long)(timeout * 1000) + 1);
+            curl_easy_setopt(eh[i], CURLOPT_CONNECTTIMEOUT_MS,
+                             (long)((timeout < CONNECT_TIMEOUT ? timeout : CONNECT_TIMEOUT) * 1000) + 1);
+            curl_easy_setopt(eh[i], CURLOPT_PRIVATE, (void *)(long)i);
+            curl_multi_add_handle(cm, eh[i]);
+        }
+        if (host[0] < 0 && host[1] < 0) {
+            break;   /* every request failed */
+        }
+
+        curl_multi_perform(cm, &still_running);
+        while ((msg = curl_multi_info_read(cm, &msgs_left)) != NULL) {
+            long i = 0;
+            double seconds = 0;
+
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&i);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &seconds);
+            curl_multi_remove_handle(cm, msg->easy_handle);
+            res = msg->data.result;
+            if (res == CURLE_OK && bufs[i]->seq < 0) {
+                /* an error page, such as a 503, carries no fragment */
+                res = CURLE_HTTP_RETURNED_ERROR;
+            }
+            host_release(hosts, host[i], seconds, res == CURLE_OK);
+            host[i] = -1;
+            if (res == CURLE_OK) {
+                winner = i;
+                break;
+            }
+        }
+        if (winner >= 0) {
+            break;
+        }
+
+        /* hedge once the request runs past the percentile of its host */
+        if (!hedged && host[0] >= 0 && policy->hedge_pct > 0 && hosts->num_hosts > 1) {
+            double threshold = host_quantile(hosts, host[0], policy->hedge_pct / 100.);
+            double elapsed = now() - start[0];
+
+            if (threshold > 0 && elapsed >= threshold) {
+                next = 1;
+                hedged = 1;
+                continue;
+            } else if (threshold > 0 && threshold - elapsed < wait) {
+                wait = threshold - elapsed;
+            }
+        }
+        if (host[0] >= 0 || host[1] >= 0) {
+            curl_multi_poll(cm, NULL, 0, (int)(wait * 1000) + 1, NULL);
+        }
     }
 
-    return pstack;
+    /* cancel the loser. A request beaten by its hedge was slow, so the time
+       it ran still counts as a sample for its host. */
+    for (int i = 0; i < 2; i++) {
+        if (host[i] >= 0) {
+            curl_multi_remove_handle(cm, eh[i]);
+            if (i == 0) {
+                host_release(hosts, host[i], now() - start[i], 1);
+            } else {
+                host_cancel(hosts, host[i]);
+            }
+        }
+    }
+    if (winner == 1) {
+        memcpy(p_recv_buf, bufs[1], sizeof(RECV_BUF) + bufs[1]->size);
+    }
+    return res;
 }
 
 /**
- * @brief release the memory
- * @param ISTACK *p the address of the ISTACK data structure
+ * @brief fetch fragment part with fetch_attempt(), retrying after a
+ *        jittered exponential backoff (see host_backoff()) until it
+ *        arrives, every host is out of retry budget or the deadline of the
+ *        job has passed
+ * @return CURLE_OK on success
  */
-
-void destroy_stack(ISTACK *p)
+CURLcode fetch_part(FETCHER *f, HOST_POOL *hosts, int img_number, int part, RECV_BUF *p_recv_buf, const FETCH_POLICY *policy)
 {
-    if ( p != NULL ) {
-        free(p);
+    CURLcode res;
+    int attempt = 0;
+
+    while ((res = fetch_attempt(f, hosts, img_number, part, p_recv_buf, policy)) != CURLE_OK) {
+        double delay = host_backoff(++attempt);
+
+        fprintf(stderr, "part %d: %s\n", part, curl_easy_strerror(res));
+        if (host_pool_exhausted(hosts)) {
+            fprintf(stderr, "part %d: every server is out of retry budget\n", part);
+            break;
+        }
+        if (policy->deadline > 0 && now() + delay >= policy->deadline) {
+            fprintf(stderr, "part %d: deadline passed\n", part);
+            break;
+        }
+        usleep(delay * 1000000);
     }
+    return res;
 }
 
 /**
- * @brief check if the stack is full
- * @param ISTACK *p the address of the ISTACK data structure
- * @return non-zero if the stack is full; zero otherwise
+ * @brief get fragment part into p_recv_buf from the fragment cache in
+ *        cache_dir, or with fetch_part() if it is not there, in which case
+ *        it is cached for the next run. cache_dir may be NULL.
+ * @return CURLE_OK on success
  */
-
-int is_full(ISTACK *p)
+CURLcode get_part(FETCHER *f, HOST_POOL *hosts, const char *cache_dir, int img_number, int part, RECV_BUF *p_recv_buf, const FETCH_POLICY *policy)
 {
-    if ( p == NULL ) {
-        return 0;
+    CURLcode res = CURLE_OK;
+    char *cached = NULL;
+    size_t cached_len = 0;
+
+    /* a fragment in the cache needs no request */
+    if (cache_dir != NULL &&
+        frag_cache_get(cache_dir, img_number, part, &cached, &cached_len) == 0 &&
+        cached_len < p_recv_buf->max_size) {
+        memcpy(p_recv_buf->buf, cached, cached_len);
+        p_recv_buf->size = cached_len;
+        p_recv_buf->seq = part;
+    } else {
+        /* get it! */
+        res = fetch_part(f, hosts, img_number, part, p_recv_buf, policy);
+        if (res == CURLE_OK && cache_dir != NULL) {
+            frag_cache_put(cache_dir, img_number, part,
+                           (char *)p_recv_buf->buf, p_recv_buf->size);
+        }
     }
-    return ( p->pos == (p->size -1) );
+    free(cached);
+    return res;
 }
 
 /**
- * @brief check if the stack is empty 
- * @param ISTACK *p the address of the ISTACK data structure
- * @return non-zero if the stack is empty; zero otherwise
+ * @brief read the width and height of the strip in fragment p from its IHDR
+ * @return 0 on success; non-zero if p does not start with an IHDR chunk
  */
-
-int is_empty(ISTACK *p)
+int strip_geometry(const RECV_BUF *p, U32 *p_width, U32 *p_height)
 {
-    if ( p == NULL ) {
-        return 0;
+    U32 width, height;
+
+    if (p->size < 33 || memcmp(p->buf + 12, "IHDR", 4) != 0) {
+        return 1;
     }
-    return ( p->pos == -1 );
+    memcpy(&width, p->buf + 16, 4);
+    memcpy(&height, p->buf + 20, 4);
+    *p_width = ntohl(width);
+    *p_height = ntohl(height);
+    return 0;
 }
 
 /**
- * @brief push one integer onto the stack 
- * @param ISTACK *p the address of the ISTACK data structure
- * @param int item the integer to be pushed onto the stack 
- * @return 0 on success; non-zero otherwise
+ * @return the receive buffer in slot k of a slab of slots slot_size bytes
+ *         apart
  */
+RECV_BUF *slab_slot(char *slab, size_t slot_size, U32 k)
+{
+    return (RECV_BUF *)(slab + k * slot_size);
+}
 
-int push(ISTACK *p, RECV_BUF item)
+/**
+ * @brief write a PNG chunk to fp. buf holds the 4 byte chunk type followed
+ *        by len bytes of chunk data, so the CRC is taken over it in one go.
+ * @return 0 on success; non-zero if the write failed
+ */
+int write_chunk(FILE *fp, U8 *buf, U32 len)
 {
-    if ( p == NULL ) {
-        return -1;
-    }
+    U32 n = htonl(len);
+    U32 c = htonl(crc(buf, 4 + len));
 
-    if ( !is_full(p) ) {
-        ++(p->pos);
-        p->items[p->pos] = item;
-        return 0;
-    } else {
-        return -1;
+    if (fwrite(&n, 4, 1, fp) != 1 || fwrite(buf, 4 + len, 1, fp) != 1 ||
+        fwrite(&c, 4, 1, fp) != 1) {
+        return 1;
     }
+    return 0;
 }
 
 /**
- * @brief push one integer onto the stack 
- * @param ISTACK *p the address of the ISTACK data structure
- * @param int *item output parameter to save the integer value 
- *        that pops off the stack 
- * @return 0 on success; non-zero otherwise
+ * @brief write the IHDR chunk of an 8 bit RGBA image of width x height
+ * @return 0 on success; non-zero if the write failed
  */
+int write_ihdr(FILE *fp, U32 width, U32 height)
+{
+    U8 buf[4 + DATA_IHDR_SIZE] = { 'I', 'H', 'D', 'R' };
+    U32 w = htonl(width);
+    U32 h = htonl(height);
+
+    memcpy(buf + 4, &w, 4);
+    memcpy(buf + 8, &h, 4);
+    buf[12] = 8;   /* bit depth */
+    buf[13] = 6;   /* colour type RGBA; compression, filter and interlace 0 */
+    return write_chunk(fp, buf, DATA_IHDR_SIZE);
+}
 
-int pop(ISTACK *p, RECV_BUF *p_item)
+/**
+ * @brief deflate the scanlines in raw into IDAT chunks of fp while the
+ *        consumers are still inflating. A consumer pushes the number of
+ *        each strip it has filled in onto done_strips. Every strip below
+ *        the first one still missing (the watermark) goes into one deflate
+ *        stream as soon as it can, so when the last strip lands little is
+ *        left to compress.
+ * @return 0 on success; non-zero if a worker gave up or zlib or the write
+ *         failed
+ */
+int deflate_strips(FILE *fp, SHM_RING *done_strips, U8 *raw, int num_strips,
+                   size_t strip_raw, size_t raw_size)
 {
-    if ( p == NULL ) {
-        return -1;
+    z_stream strm;
+    U8 *idat = malloc(4 + IDAT_MAX);   /* "IDAT" then the zlib data */
+    U8 *landed = calloc(num_strips, 1);
+    int watermark = 0;                 /* strips below it are in the stream */
+    int ret;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (idat == NULL || landed == NULL ||
+        deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(idat);
+        free(landed);
+        return 1;
     }
+    memcpy(idat, "IDAT", 4);
+    strm.next_out = idat + 4;
+    strm.avail_out = IDAT_MAX;
+
+    ret = Z_OK;
+    while (ret == Z_OK && watermark < num_strips) {
+        U32 seq;
+        int end = watermark;
+        int flush;
+
+        if (shm_ring_pop(done_strips, &seq) != 0) {
+            ret = Z_ERRNO;   /* a worker gave up */
+            break;
+        }
+        landed[seq] = 1;
+        while (end < num_strips && landed[end]) {
+            end++;
+        }
+        if (end == watermark) {
+            continue;
+        }
 
-    if ( !is_empty(p) ) {
-        *p_item = p->items[p->pos];
-        (p->pos)--;
-        return 0;
-    } else {
+        /* the last strip may be taller than the others */
+        strm.next_in = raw + watermark * strip_raw;
+        strm.avail_in = (end == num_strips ? raw_size : end * strip_raw) - watermark * strip_raw;
+        watermark = end;
+        flush = watermark == num_strips ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            ret = deflate(&strm, flush);
+            if (strm.avail_out == 0 || ret == Z_STREAM_END) {
+                if (write_chunk(fp, idat, IDAT_MAX - strm.avail_out) != 0) {
+                    ret = Z_ERRNO;
+                }
+                strm.next_out = idat + 4;
+                strm.avail_out = IDAT_MAX;
+            }
+        } while (ret == Z_OK && (flush == Z_FINISH || strm.avail_in > 0));
+    }
+
+    (void) deflateEnd(&strm);
+    free(idat);
+    free(landed);
+    if (ret != Z_STREAM_END) {
+        zerr(ret);
         return 1;
     }
+    return 0;
 }
-typedef struct INF_BUF {
-    U8 buf[9606];       /* memory to hold a copy of received data */
-    int seq;         /* >=0 sequence number extracted from http header */
-                     /* <0 indicates an invalid seq number */
-} INF_BUF;
+
  
 
 
-int main( int argc, char** argv ) 
+/**
+ * @brief park worker i of pool for as long as it is not one of the active
+ *        workers. Not FUTEX_PRIVATE_FLAG: the workers are processes.
+ */
+void pool_park(WORKER_POOL *pool, int i)
 {
+    while (1) {
+        unsigned int gate = __atomic_load_n(&pool->gate, __ATOMIC_ACQUIRE);
 
-    if (argc < 5){
-        printf("invalid input");
-        return 0;
+        if (i < __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        syscall(SYS_futex, &pool->gate, FUTEX_WAIT, gate, NULL, NULL, 0);
     }
-    int B = atoi(argv[1]);
-    int P = atoi(argv[2]);
-    int C = atoi(argv[3]);
-    int X = atoi(argv[4]);
-    int N = atoi(argv[5]);
+}
 
-    ISTACK *strip_buffer;
-    int strip_shmid = shmget(IPC_PRIVATE, sizeof_shm_stack(B), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    if (strip_shmid == -1){
-        perror("shmget");
-        abort();
-    }
-    strip_buffer = shmat(strip_shmid, NULL, 0);
-    init_shm_stack(strip_buffer, (B));
-    
+/**
+ * @brief let workers 0 to n - 1 of pool run and park the rest, each once
+ *        it is done with the fragments it holds
+ */
+void pool_resize(WORKER_POOL *pool, int n)
+{
+    __atomic_store_n(&pool->active, n, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pool->gate, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &pool->gate, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
 
-    INF_BUF *inflated_buffer;
-    int INF_shmid = shmget(IPC_PRIVATE, sizeof(INF_BUF) * 50, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    if (INF_shmid == -1){
-        perror("shmget");
-        abort();
+/**
+ * @brief a worker of pool spent seconds on n fragments
+ */
+void pool_account(WORKER_POOL *pool, double seconds, int n)
+{
+    __atomic_add_fetch(&pool->busy_ns, (long)(seconds * 1000000000.), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->done, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief give up on the image before every worker is running: tell the
+ *        ones forked so far, wake them wherever they wait and reap them
+ */
+void stop_workers(PASTER_CTL *ctl, SHM_RING **rings, int num_rings,
+                  const pid_t *prod, int num_prod, const pid_t *cons, int num_cons)
+{
+    __atomic_store_n(&ctl->aborted, 1, __ATOMIC_RELEASE);
+    for (int k = 0; k < num_rings; k++) {
+        shm_ring_close(rings[k]);
+    }
+    pool_resize(&ctl->prod, num_prod);
+    pool_resize(&ctl->cons, num_cons);
+    for (int i = 0; i < num_prod; i++) {
+        waitpid(prod[i], NULL, 0);
     }
-    inflated_buffer = shmat(INF_shmid, NULL, 0);
+    for (int i = 0; i < num_cons; i++) {
+        waitpid(cons[i], NULL, 0);
+    }
+}
 
-    int *total_height ;
-    int *width ;
+/**
+ * @brief autoscaling supervisor, a thread of main. Every SAMPLE_MS it
+ *        updates the average time a producer takes to fetch a fragment and
+ *        a consumer to get through one, and sizes the pools from them. By
+ *        Little's law n workers taking t seconds a fragment move n / t
+ *        fragments a second, so both pools are sized for the rate of the
+ *        slower one at full strength; any more workers on the faster side
+ *        would only wait. The fill of the ring between them then adds one
+ *        worker where the work piles up: a consumer if it is full, a
+ *        producer if it is empty.
+ */
+void *supervise(void *arg)
+{
+    SUPERVISOR *sv = arg;
+    WORKER_POOL *pools[2] = { &sv->ctl->prod, &sv->ctl->cons };
+    int max[2] = { sv->max_prod, sv->max_cons };
+    double per_frag[2] = { 0, 0 };  /* smoothed seconds per fragment */
+    long busy[2] = { 0, 0 };
+    long done[2] = { 0, 0 };
+
+    pthread_mutex_lock(&sv->lock);
+    while (!sv->stop) {
+        struct timespec until;
+        int want[2];
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += SAMPLE_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&sv->cond, &sv->lock, &until);
+        if (sv->stop) {
+            break;
+        }
 
-    int shm_total_height_id = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int shm_width_id = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+        for (int k = 0; k < 2; k++) {
+            long b = __atomic_load_n(&pools[k]->busy_ns, __ATOMIC_RELAXED);
+            long d = __atomic_load_n(&pools[k]->done, __ATOMIC_RELAXED);
 
-    total_height = shmat(shm_total_height_id, NULL, 0);
-    width = shmat(shm_width_id, NULL, 0);
+            if (d > done[k]) {
+                double t = (b - busy[k]) / 1000000000. / (d - done[k]);
 
-    int *prod_count ;
-    int *cons_count ;
+                per_frag[k] = per_frag[k] == 0 ? t : per_frag[k] + SAMPLE_WEIGHT * (t - per_frag[k]);
+            }
+            busy[k] = b;
+            done[k] = d;
+            want[k] = __atomic_load_n(&pools[k]->active, __ATOMIC_RELAXED);
+        }
+        if (per_frag[0] > 0 && per_frag[1] > 0) {
+            double rate = fmin(max[0] / per_frag[0], max[1] / per_frag[1]);
 
-    int shm_prod_cons_id = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int shm_cons_count_id = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+            for (int k = 0; k < 2; k++) {
+                want[k] = (int)ceil(rate * per_frag[k] - 1e-9);
+            }
+        }
+        int fill = shm_ring_count(sv->strips);
+        if (fill >= sv->strips->size) {
+            want[1]++;
+        } else if (fill == 0) {
+            want[0]++;
+        }
 
-    prod_count = shmat(shm_prod_cons_id, NULL, 0);
-    cons_count = shmat(shm_cons_count_id, NULL, 0);
+        for (int k = 0; k < 2; k++) {
+            want[k] = want[k] < 1 ? 1 : want[k] > max[k] ? max[k] : want[k];
+            if (want[k] != __atomic_load_n(&pools[k]->active, __ATOMIC_RELAXED)) {
+                pool_resize(pools[k], want[k]);
+                if (sv->verbose) {
+                    fprintf(stderr, "autoscale: %d of %d %s (%.1f ms a fragment)\n", want[k],
+                            max[k], k == 0 ? "producers" : "consumers", per_frag[k] * 1000);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&sv->lock);
+    return NULL;
+}
 
-    //semaphore memory
+/**
+ * @brief print on stderr which CPUs, and so which NUMA nodes, who runs on;
+ *        set NULL means wherever main may run
+ */
+void report_cpus(const char *who, const cpu_set_t *set)
+{
+    cpu_set_t any;
+    char cpus[256];
+    char nodes[256];
 
-    sem_t *sem_buff;
-    sem_t *sem_empty;
-    sem_t *sem_filled;
-    sem_t *sem_prod_count;
-    sem_t *sem_cons_count;
+    if (set == NULL) {
+        sched_getaffinity(0, sizeof(any), &any);
+        set = &any;
+    }
+    cpuset_format(set, cpus, sizeof(cpus));
+    nodemask_format(cpuset_nodes(set), nodes, sizeof(nodes));
+    fprintf(stderr, "placement: %s on CPUs %s (node %s)%s\n", who, cpus, nodes,
+            set == &any ? ", not pinned" : "");
+}
 
+/**
+ * @brief print on stderr on which NUMA nodes the pages of a region are
+ */
+void report_pages(const char *name, void *addr, size_t len, size_t page)
+{
+    int count[PLACE_MAX_NODES];
 
-    int sem_buff_shmid = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int sem_empty_shmid = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int sem_filled_shmid = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int sem_prod_count_shmid = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int sem_cons_count_shmid = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    if (place_count(addr, len, page, count) < 0) {
+        perror("placement: move_pages");
+        return;
+    }
+    fprintf(stderr, "placement: %s pages", name);
+    for (int node = 0; node < PLACE_MAX_NODES; node++) {
+        if (count[node] > 0) {
+            fprintf(stderr, " %d on node %d", count[node], node);
+        }
+    }
+    fprintf(stderr, "\n");
+}
 
-    sem_buff = shmat(sem_buff_shmid, NULL, 0);
-    sem_empty = shmat(sem_empty_shmid, NULL, 0);
-    sem_filled = shmat(sem_filled_shmid, NULL, 0);
-    sem_prod_count = shmat(sem_prod_count_shmid, NULL, 0);
-    sem_cons_count = shmat(sem_cons_count_shmid, NULL, 0);
+/**
+ * @brief print how paster2 is run to stderr
+ */
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [OPTIONS] B P C X N\n"
+            "  B  fragments the ring between producers and consumers holds\n"
+            "  P  producers, C  consumers (upper bounds with -a)\n"
+            "  X  ms a consumer sleeps per fragment, N  image number\n"
+            "  -s HOSTS             servers to fetch from, host[:port],...\n"
+            "  -H PCT               latency percentile that triggers a hedge, 0 is off\n"
+            "  -d SECONDS           deadline of the whole job\n"
+            "  -c DIR               fragment cache shared between runs\n"
+            "  -L                   shared arena on huge pages\n"
+            "  -k K                 most fragments a consumer takes at once\n"
+            "  -a                   scale producers and consumers to the work\n"
+            "  -v                   report latency, hedging and placement\n"
+            "  --producer-cpus=LIST run the producers on the CPUs of LIST, e.g. 0-3,8\n"
+            "  --consumer-cpus=LIST run the consumers and main on the CPUs of LIST\n"
+            "  -N                   put the arena on the NUMA nodes of the consumers\n",
+            prog);
+}
 
-    sem_init(sem_buff, 1, 1);
-    sem_init(sem_empty, 1, B);
-    sem_init(sem_filled, 1, 0);
-    sem_init(sem_prod_count, 1,1);
-    sem_init(sem_cons_count, 1, 1);
+int main( int argc, char** argv ) 
+{
 
-        
+    int c;
+    int verbose = 0;
+    FETCH_POLICY policy = { HEDGE_PCT, 0 };
+    double deadline = 0;
+    char *host_list = ECE252_HOSTS;
+    char *cache_dir = NULL;
+    int huge = 0;
+    int batch = CONS_BATCH;
+    int autoscale = 0;
+    cpu_set_t prod_cpus;
+    cpu_set_t cons_cpus;
+    int pin_prod = 0;
+    int pin_cons = 0;
+    int bind_arena = 0;
+    cpu_set_t allowed;
+    /* P and C are the positional counts, so the CPU sets have no letter */
+    static const struct option long_opts[] = {
+        { "producer-cpus", required_argument, NULL, OPT_PROD_CPUS },
+        { "consumer-cpus", required_argument, NULL, OPT_CONS_CPUS },
+        { NULL, 0, NULL, 0 }
+    };
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    while ((c = getopt_long (argc, argv, "s:H:vd:c:Lk:aN", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            host_list = optarg;
+            break;
+        case 'H':
+            policy.hedge_pct = atoi(optarg);
+            if (policy.hedge_pct < 0 || policy.hedge_pct >= 100) {
+                fprintf(stderr, "%s: option requires an argument 0 (off) to 99 -- 'H'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case 'd':
+            deadline = strtod(optarg, NULL);   /* seconds for the whole job */
+            if (deadline <= 0) {
+                fprintf(stderr, "%s: option requires an argument > 0 -- 'd'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'c':
+            cache_dir = optarg;   /* fragment cache shared between runs */
+            if (frag_cache_init(cache_dir) != 0) {
+                return -1;
+            }
+            break;
+        case 'L':
+            huge = 1;   /* shared arena on huge pages */
+            break;
+        case 'a':
+            autoscale = 1;   /* P and C are upper bounds */
+            break;
+        case 'k':
+            batch = atoi(optarg);   /* most fragments a consumer takes at once */
+            if (batch <= 0) {
+                fprintf(stderr, "%s: option requires an argument > 0 -- 'k'\n", argv[0]);
+                return -1;
+            }
+            break;
+        case OPT_PROD_CPUS:
+            if (cpuset_parse(optarg, &prod_cpus) != 0) {
+                fprintf(stderr, "%s: option requires a CPU list such as 0-3,8 -- 'producer-cpus'\n", argv[0]);
+                return -1;
+            }
+            CPU_AND(&prod_cpus, &prod_cpus, &allowed);
+            if (CPU_COUNT(&prod_cpus) == 0) {
+                fprintf(stderr, "%s: no CPU of the list can be used -- 'producer-cpus'\n", argv[0]);
+                return -1;
+            }
+            pin_prod = 1;
+            break;
+        case OPT_CONS_CPUS:
+            if (cpuset_parse(optarg, &cons_cpus) != 0) {
+                fprintf(stderr, "%s: option requires a CPU list such as 0-3,8 -- 'consumer-cpus'\n", argv[0]);
+                return -1;
+            }
+            CPU_AND(&cons_cpus, &cons_cpus, &allowed);
+            if (CPU_COUNT(&cons_cpus) == 0) {
+                fprintf(stderr, "%s: no CPU of the list can be used -- 'consumer-cpus'\n", argv[0]);
+                return -1;
+            }
+            pin_cons = 1;   /* main too, it deflates what they inflate */
+            break;
+        case 'N':
+            bind_arena = 1;   /* slab and raw on the consumers' nodes */
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    char *prog = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
 
+    if (argc < 6){
+        usage(prog);
+        return -1;
+    }
+    int B = atoi(argv[1]);
+    int P = atoi(argv[2]);
+    int C = atoi(argv[3]);
+    int X = atoi(argv[4]);
+    int N = atoi(argv[5]);
 
-    RECV_BUF recv_buf;
-    pid_t prod[P];
-    pid_t cons[C];
+    if (deadline > 0) {
+        policy.deadline = now() + deadline;
+    }
 
-  double times[2];
+    /* the arena is sized once the image is known, until then main alone
+       talks to the servers through a pool of its own */
+    HOST_POOL meta_hosts;
+    if (host_pool_init(&meta_hosts, host_list, ECE252_PORT, 0) != 0) {
+        fprintf(stderr, "invalid server list -- 's'\n");
+        return -1;
+    }
+
+    double times[2];
     struct timeval tv;
 
     if (gettimeofday(&tv, NULL) != 0) {
@@ -488,6 +1087,212 @@ int main( int argc, char** argv )
     }
     times[0] = (tv.tv_sec) + tv.tv_usec/1000000.;
 
+    /* The first fragment is the metadata request: its IHDR gives the width
+       of the image and the height of a strip, and the server may say how
+       many fragments there are. The last fragment takes the rows left over,
+       so it is fetched next and then the image is known to the byte. Both
+       go down the pipeline like any other fragment afterwards. The fragment
+       count rides on the reply, so the first fragment is only taken from
+       the cache if the count was cached with it. */
+    RECV_BUF *meta[2];
+    int num_meta = 1;
+    int num_strips = ECE252_FRAGS;
+    U32 strip_width = 0, strip_height = 0, last_width = 0, last_height = 0;
+    CURLcode meta_res;
+
+    meta[0] = malloc(sizeof(RECV_BUF) + META_BUF_SIZE);
+    meta[1] = malloc(sizeof(RECV_BUF) + META_BUF_SIZE);
+    recv_buf_init(meta[0], META_BUF_SIZE);
+    recv_buf_init(meta[1], META_BUF_SIZE);
+    /* once for the whole run, the workers inherit it */
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    FETCHER meta_fetcher;
+    int cached_frags = 0;
+    if (fetcher_init(&meta_fetcher) != 0) {
+        meta_res = CURLE_FAILED_INIT;
+    } else if (cache_dir != NULL && frag_cache_get_count(cache_dir, N, &cached_frags) == 0) {
+        meta_res = get_part(&meta_fetcher, &meta_hosts, cache_dir, N, 0, meta[0], &policy);
+        if (meta_res == CURLE_OK && meta[0]->num_frags == 0) {
+            meta[0]->num_frags = cached_frags;
+        }
+    } else {
+        meta_res = fetch_part(&meta_fetcher, &meta_hosts, N, 0, meta[0], &policy);
+        if (meta_res == CURLE_OK && cache_dir != NULL) {
+            /* the count first: a cached fragment 0 then always has one */
+            frag_cache_put_count(cache_dir, N, meta[0]->num_frags);
+            frag_cache_put(cache_dir, N, 0, (char *)meta[0]->buf, meta[0]->size);
+        }
+    }
+    if (meta_res == CURLE_OK) {
+        /* every strip but the last is strip_height rows, and the last has
+           at least one, so a count that makes the image taller than
+           MAX_HEIGHT cannot be right. That goes for a cached one too. */
+        if (meta[0]->num_frags > 0) {
+            if (meta[0]->num_frags <= MAX_HEIGHT &&
+                strip_geometry(meta[0], &strip_width, &strip_height) == 0 &&
+                (U64)(meta[0]->num_frags - 1) * strip_height < MAX_HEIGHT) {
+                num_strips = meta[0]->num_frags;
+            } else {
+                fprintf(stderr, "paster2: image %d: fragment count %d ignored, taking %d\n",
+                        N, meta[0]->num_frags, ECE252_FRAGS);
+            }
+        }
+        if (num_strips > 1) {
+            num_meta = 2;
+            meta_res = get_part(&meta_fetcher, &meta_hosts, cache_dir, N, num_strips - 1, meta[1], &policy);
+        }
+    }
+    /* main fetches nothing more, the producers make handles of their own */
+    fetcher_cleanup(&meta_fetcher);
+    if (meta_res != CURLE_OK ||
+        strip_geometry(meta[0], &strip_width, &strip_height) != 0 ||
+        strip_geometry(meta[num_meta - 1], &last_width, &last_height) != 0 ||
+        strip_width == 0 || strip_height == 0 || last_width != strip_width || last_height == 0) {
+        fprintf(stderr, "paster2: failed to fetch image %d\n", N);
+        free(meta[0]);
+        free(meta[1]);
+        host_pool_destroy(&meta_hosts);
+        curl_global_cleanup();
+        return 1;
+    }
+
+    /* each row is a filter byte and width RGBA pixels */
+    size_t row_size = (size_t)strip_width * 4 + 1;
+    size_t strip_raw = strip_height * row_size;
+    size_t last_raw = last_height * row_size;
+    size_t max_raw = strip_raw > last_raw ? strip_raw : last_raw;
+    /* room for the largest fragment and the '\0' write_cb_curl() adds */
+    size_t slot_buf_size = PNG_OVERHEAD + compressBound(max_raw) + 1;
+    size_t slot_size = (sizeof(RECV_BUF) + slot_buf_size + sizeof(size_t) - 1) /
+                       sizeof(size_t) * sizeof(size_t);
+
+    /* Fragments live in a slab of receive buffers and only their 32 bit
+       slot numbers travel through the rings. A producer takes a free slot
+       and curls straight into it, the slot goes through strip_buffer to a
+       consumer, and the consumer puts it back on free_slots. With one slot
+       per producer, per place in strip_buffer and per fragment a consumer
+       may hold, a producer never has to wait for a free one. */
+    int num_slots = P + B + C * batch + num_meta;
+    /* the filtered scanlines of the whole image, top to bottom: consumers
+       inflate each fragment straight into its place and main deflates the
+       lot where it lies */
+    size_t raw_size = (num_strips - 1) * strip_raw + last_raw;
+
+    /* everything the processes share, in one arena */
+    ARENA_HEADER layout;
+    arena_layout_init(&layout);
+    int ctl_region = arena_reserve(&layout, "ctl", sizeof(PASTER_CTL));
+    int hosts_region = arena_reserve(&layout, "hosts", sizeof(HOST_POOL));
+    int free_region = arena_reserve(&layout, "free_slots", shm_ring_sizeof(num_slots, sizeof(U32)));
+    /* slots of fetched fragments on their way to the consumers */
+    int strip_region = arena_reserve(&layout, "strip_buffer", shm_ring_sizeof(B, sizeof(U32)));
+    /* numbers of the strips inflated so far, for main to deflate. It holds
+       every strip, so a consumer never waits to push one. */
+    int done_region = arena_reserve(&layout, "done_strips", shm_ring_sizeof(num_strips, sizeof(U32)));
+    int slab_region = arena_reserve(&layout, "slab", slot_size * num_slots);
+    int raw_region = arena_reserve(&layout, "raw", raw_size);
+
+    /* the consumers read the slab and write raw, so with -N both go on
+       the nodes of their CPUs. The arena binds them before anything
+       touches its pages; without it raw lands where the consumer that
+       first writes a page runs, which with --consumer-cpus is one of
+       theirs too. */
+    unsigned long arena_nodes = 0;
+    if (bind_arena) {
+        cpu_set_t cpus;
+
+        if (pin_cons) {
+            cpus = cons_cpus;
+        } else {
+            sched_getaffinity(0, sizeof(cpus), &cpus);
+        }
+        arena_nodes = cpuset_nodes(&cpus);
+    }
+    ARENA_HEADER *arena = shm_arena_create(&layout, huge, arena_nodes,
+                                           (1U << slab_region) | (1U << raw_region));
+    if (arena == NULL) {
+        fprintf(stderr, "paster2: no shared memory for image %d\n", N);
+        free(meta[0]);
+        free(meta[1]);
+        host_pool_destroy(&meta_hosts);
+        curl_global_cleanup();
+        return 1;
+    }
+    bind_arena = arena->nodes != 0;   /* if not, the kernel places them */
+    PASTER_CTL *ctl = shm_arena_region(arena, ctl_region);
+    HOST_POOL *hosts = shm_arena_region(arena, hosts_region);
+    SHM_RING *free_slots = shm_arena_region(arena, free_region);
+    SHM_RING *strip_buffer = shm_arena_region(arena, strip_region);
+    SHM_RING *done_strips = shm_arena_region(arena, done_region);
+    char *slab = shm_arena_region(arena, slab_region);
+    U8 *raw = shm_arena_region(arena, raw_region);
+    size_t page = arena->huge ? ARENA_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+
+    host_pool_init(hosts, host_list, ECE252_PORT, 1);
+    /* keep what the metadata requests learnt about the servers */
+    memcpy(hosts->hosts, meta_hosts.hosts, sizeof(meta_hosts.hosts));
+    host_pool_destroy(&meta_hosts);
+
+    for (U32 k = 0; k < num_slots; k++) {
+        recv_buf_init(slab_slot(slab, slot_size, k), slot_buf_size);
+    }
+    shm_ring_init(free_slots, num_slots, sizeof(U32));
+    for (U32 k = 0; k < num_slots; k++) {
+        shm_ring_push(free_slots, &k);
+    }
+    shm_ring_init(strip_buffer, B, sizeof(U32));
+    shm_ring_init(done_strips, num_strips, sizeof(U32));
+
+    /* park the fragments main fetched in slots of their own, they are
+       handed to the consumers once those are running */
+    U32 meta_slot[2];
+    for (int k = 0; k < num_meta; k++) {
+        RECV_BUF *p;
+
+        shm_ring_pop(free_slots, &meta_slot[k]);
+        p = slab_slot(slab, slot_size, meta_slot[k]);
+        if (meta[k]->size >= p->max_size) {
+            fprintf(stderr, "paster2: fragment %d is larger than its geometry allows\n", meta[k]->seq);
+            free(meta[0]);
+            free(meta[1]);
+            host_pool_destroy(hosts);
+            shm_arena_destroy(arena);
+            curl_global_cleanup();
+            return 1;
+        }
+        memcpy(p->buf, meta[k]->buf, meta[k]->size);
+        p->size = meta[k]->size;
+        p->seq = meta[k]->seq;
+    }
+    free(meta[0]);
+    free(meta[1]);
+
+    int *total_height = &ctl->total_height;
+    int *width = &ctl->width;
+    int *prod_count = &ctl->prod_count;
+    *prod_count = 1;   /* main has fetched the first fragment */
+    ctl->prod.active = P;
+    ctl->cons.active = C;
+
+    int report_placement = verbose || pin_prod || pin_cons || bind_arena;
+    if (report_placement) {
+        report_cpus("producers", pin_prod ? &prod_cpus : NULL);
+        report_cpus("consumers and main", pin_cons ? &cons_cpus : NULL);
+        fprintf(stderr, "placement: slab and raw %s\n",
+                bind_arena ? "bound to the consumers' nodes" : "placed on first touch");
+    }
+
+    /* set when a producer gives up on a fragment, every process then stops */
+    int *aborted = &ctl->aborted;
+    SHM_RING *rings[3] = { strip_buffer, free_slots, done_strips };
+
+        
+
+
+    pid_t prod[P];
+    pid_t cons[C];
+
+
     for (int i =0 ; i < P; i++){
         pid_t pid = fork();
         if(pid >0) {
@@ -496,82 +1301,55 @@ int main( int argc, char** argv )
 
         }
         else if ( pid == 0){
+                if (pin_prod && sched_setaffinity(0, sizeof(prod_cpus), &prod_cpus) != 0) {
+                    perror("paster2: sched_setaffinity");
+                }
 
+                /* one set of handles for every fragment this producer gets,
+                   so its connections stay open between them */
+                FETCHER fetcher;
+                int no_fetcher = fetcher_init(&fetcher);
                  
                 while(1){
-                    int sequence_num =0;
-                    sem_wait(sem_prod_count);
+                    pool_park(&ctl->prod, i);
+
+                    /* claim a fragment; main has the last one as well */
+                    int sequence_num = __atomic_fetch_add(prod_count, 1, __ATOMIC_RELAXED);
 
-                    if(*prod_count == 50){
-                        sem_post(sem_prod_count);
+                    if(sequence_num >= num_strips - 1 || __atomic_load_n(aborted, __ATOMIC_ACQUIRE)){
+                        fetcher_cleanup(&fetcher);
                         exit(0);
                     }
-                    sequence_num = *prod_count;
-                    *prod_count +=1;
-                
-                    sem_post(sem_prod_count);
 
-                    CURL *curl_handle;
                     CURLcode res;
-                    char url[256];
-                    
-                    //RECV_BUF *p_shm_recv_buf;
-
-                    //int shmid;
-                    //int shm_size = sizeof_shm_recv_buf(BUF_SIZE);
-                    char fname[256];
-                    pid_t pid =getpid();
-                   // printf("aaa\n");
-
-                    //shm_recv_buf_init(&recv_buf, BUF_SIZE);
-                    recv_buf_init(&recv_buf, BUF_SIZE);
-
-                    //printf("ggg\n");
-                    
-                    
-                    sprintf(url, "http://ece252-%d.uwaterloo.ca:2530/image?img=%d&part=%d",sequence_num%3 +1 , N, sequence_num);
-                    //printf("ggg\n");
-                    //printf("URL is %s\n", url);
-                    
-                    
-                    curl_global_init(CURL_GLOBAL_DEFAULT);
+                    RECV_BUF *recv_buf;
+                    U32 slot;
 
-                    /* init a curl session */
-                    curl_handle = curl_easy_init();
-
-                    if (curl_handle == NULL) {
-                        fprintf(stderr, "curl_easy_init: returned NULL\n");
-                        return 1;
+                    if (shm_ring_pop(free_slots, &slot) != 0) {
+                        fetcher_cleanup(&fetcher);
+                        exit(1);   /* another producer gave up */
                     }
+                    recv_buf = slab_slot(slab, slot_size, slot);
 
-                    /* specify URL to get */
-                    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-
-                    /* register write call back function to process received data */
-                    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl); 
-                    /* user defined data structure passed to the call back function */
-                    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_buf);
-
-                    /* register header call back function to process received header data */
-                    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl); 
-                    /* user defined data structure passed to the call back function */
-                    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
-
-                    /* some servers requires a user-agent field */
-                    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-                    
-                    /* get it! */
-                    res = curl_easy_perform(curl_handle);
+                    double start = now();
+                    res = no_fetcher ? CURLE_FAILED_INIT :
+                          get_part(&fetcher, hosts, cache_dir, N, sequence_num, recv_buf, &policy);
+                    pool_account(&ctl->prod, now() - start, 1);
 
                     if( res != CURLE_OK) {
-                        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+                        /* never hand the consumers an empty buffer: give up on
+                           the image and wake everybody so that they see it */
+                        __atomic_store_n(aborted, 1, __ATOMIC_RELEASE);
+                        shm_ring_close(strip_buffer);
+                        shm_ring_close(free_slots);
+                        shm_ring_close(done_strips);
+                        fetcher_cleanup(&fetcher);
+                        exit(1);
                     } 
-                    sem_wait(sem_empty);
-                    sem_wait(sem_buff);
-                    push(strip_buffer, recv_buf);
-                    sem_post(sem_buff);
-                    sem_post(sem_filled);
+                    if (shm_ring_push(strip_buffer, &slot) != 0) {
+                        fetcher_cleanup(&fetcher);
+                        exit(1);   /* another producer gave up */
+                    }
                     //printf("%i\n", strip_buffer->items[i].seq);
                     
                     // int *t = shmat(data_shmid, NULL, 0);
@@ -582,9 +1360,6 @@ int main( int argc, char** argv )
                 
                     //write_file(fname, recv_buf.buf, recv_buf.size);
 
-                    /* cleaning up */
-                    curl_easy_cleanup(curl_handle);
-                    curl_global_cleanup();
                     //recv_buf_cleanup(&recv_buf);
 
                 }
@@ -594,75 +1369,105 @@ int main( int argc, char** argv )
         }
         else{
             perror("forking issue");
-            abort();
+            stop_workers(ctl, rings, 3, prod, i, cons, 0);
+            host_pool_destroy(hosts);
+            shm_arena_destroy(arena);
+            curl_global_cleanup();
+            return 1;
         }
     }
 
-    int offset = 0;
     for (int i =0 ; i < C; i++){
         pid_t pid = fork();
         if(pid>0){
             cons[i]=pid;
         }
         else if (pid == 0){
+            if (pin_cons && sched_setaffinity(0, sizeof(cons_cpus), &cons_cpus) != 0) {
+                perror("paster2: sched_setaffinity");
+            }
 
-            while(1){
-
-                
-                sem_wait(sem_cons_count);
+            /* one inflate stream for every fragment this consumer takes */
+            z_stream strm;
+            U32 slots[batch];
+            U32 done[batch];
+
+            strm.zalloc = Z_NULL;
+            strm.zfree = Z_NULL;
+            strm.opaque = Z_NULL;
+            strm.avail_in = 0;
+            strm.next_in = Z_NULL;
+            if (inflateInit(&strm) != Z_OK) {
+                fprintf(stderr, "paster2: inflateInit failed\n");
+                __atomic_store_n(aborted, 1, __ATOMIC_RELEASE);
+                shm_ring_close(strip_buffer);
+                shm_ring_close(free_slots);
+                shm_ring_close(done_strips);
+                exit(1);
+            }
 
-                if(*cons_count == 50){
-                        sem_post(sem_cons_count);
-                        exit(0);
+            while(1){
+                pool_park(&ctl->cons, i);
+
+                /* take up to batch fragments at once. Main closes the
+                   ring once the image is complete. */
+                int n = shm_ring_pop_batch(strip_buffer, slots, batch);
+                if (n < 0) {
+                    inflateEnd(&strm);
+                    exit(0);   /* done, or a producer gave up */
                 }
-                *cons_count +=1;
-      
-
-                sem_post(sem_cons_count);
-
-                RECV_BUF *cons_buf = malloc(sizeof(RECV_BUF));
-
-                sem_wait(sem_filled);
-                sem_wait(sem_buff);
-                pop(strip_buffer, cons_buf);
-                sem_post(sem_buff);
-                sem_post(sem_empty);
-
-             
-                data_IHDR_p data_IHDR = malloc(DATA_IHDR_SIZE);
-                // printf("fdsf3\n");
-                memcpy(data_IHDR, cons_buf->buf + 16, 13);
-                // printf("fdsf4\n");
-                *total_height += ntohl(data_IHDR -> height);
-
-                *width = ntohl(data_IHDR->width);
-                free(data_IHDR);
-
-
-
-                //write_file("22.png", cons_buf->buf, cons_buf->size);
-                
-                //memcpy(cons_buf.buf ,strip_buffer->items[i].buf, strip_buffer->items[i].size);
-                // cons_buf.seq = strip_buffer->items[i].seq;
-                // cons_buf.size = strip_buffer->items[i].size;
-                U64 inf_data_length = 0;
-                
-                //mem_inf(inflated_data, &inflated_data_length, data_buffer, ntohl(chunk_IDAT->length) );
-                INF_BUF temp_inf_buf;
-                temp_inf_buf.seq = cons_buf->seq;
-
-                int idat_data_length;
-                memcpy (&idat_data_length, cons_buf-> buf + 33 ,4);
-                
-                mem_inf(&temp_inf_buf.buf, &inf_data_length, cons_buf->buf + 41, ntohl(idat_data_length) );
+                double start = now();
+
+                for (int j = 0; j < n; j++) {
+                    RECV_BUF *cons_buf = slab_slot(slab, slot_size, slots[j]);
+
+                    /* every fragment but the last is as tall as the first, so
+                       fragment seq starts seq strips down */
+                    int seq = cons_buf->seq;
+                    U32 frag_width = 0, frag_height = 0;
+                    U64 inf_data_length = seq == num_strips - 1 ? last_raw : strip_raw;
+                    size_t offset = (size_t)seq * strip_raw;
+                    U64 expected = inf_data_length;
+
+                    /* the IDAT data starts at byte 41, after the signature,
+                       IHDR and the IDAT length and type, and must end, CRC
+                       and all, within the fragment */
+                    U32 idat_data_length = 0;
+                    if (cons_buf->size >= 41 + 4) {
+                        memcpy (&idat_data_length, cons_buf-> buf + 33 ,4);
+                        idat_data_length = ntohl(idat_data_length);
+                    }
 
-                usleep(X*1000);
-                //memcpy(inflated_buffer + offset, &temp_inf_buf, inf_data_length );
+                    if (seq < 0 || seq >= num_strips ||
+                        cons_buf->size < 41 + 4 ||
+                        41 + (U64)idat_data_length + 4 > cons_buf->size ||
+                        strip_geometry(cons_buf, &frag_width, &frag_height) != 0 ||
+                        frag_width != strip_width ||
+                        frag_height * row_size != expected ||
+                        mem_inf_reuse(&strm, raw + offset, &inf_data_length, cons_buf->buf + 41,
+                                      idat_data_length) != 0 ||
+                        inf_data_length != expected) {
+                        fprintf(stderr, "paster2: bad fragment %d\n", seq);
+                        __atomic_store_n(aborted, 1, __ATOMIC_RELEASE);
+                        shm_ring_close(strip_buffer);
+                        shm_ring_close(free_slots);
+                        shm_ring_close(done_strips);
+                        exit(1);
+                    }
 
-                //offset += sizeof(temp_inf_buf);
-                inflated_buffer[cons_buf->seq] = temp_inf_buf;
-                free(cons_buf);
+                    /* every fragment was checked to be as wide as the first,
+                       so the first consumer here sets the width for all */
+                    int no_width = 0;
+                    __atomic_fetch_add(total_height, frag_height, __ATOMIC_RELAXED);
+                    __atomic_compare_exchange_n(width, &no_width, frag_width, 0,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                    done[j] = seq;
+                }
+                shm_ring_push_batch(done_strips, done, n);
 
+                usleep(n*X*1000);
+                pool_account(&ctl->cons, now() - start, n);
+                shm_ring_push_batch(free_slots, slots, n);
                 //printf("%i\n" , offset);
                 //write_file("22.png", cons_buf.buf, cons_buf.size);
 
@@ -671,169 +1476,118 @@ int main( int argc, char** argv )
 
         else{
             perror("fork error");
-            abort();
+            stop_workers(ctl, rings, 3, prod, P, cons, i);
+            host_pool_destroy(hosts);
+            shm_arena_destroy(arena);
+            curl_global_cleanup();
+            return 1;
         }
     }
-    
 
-    for(int i = 0; i<P;i++){
-        wait(prod[i]);
-    }
-      for(int i = 0; i<C;i++){
-        wait(cons[i]);
+    if (pin_cons && sched_setaffinity(0, sizeof(cons_cpus), &cons_cpus) != 0) {
+        perror("paster2: sched_setaffinity");
     }
-    
-  
 
-    //char *inflated_buffer = malloc(9000000);
+    /* with -a a thread of main sizes the pools while the image is pasted */
+    SUPERVISOR sv = { .ctl = ctl, .strips = strip_buffer, .max_prod = P, .max_cons = C,
+                      .verbose = verbose, .lock = PTHREAD_MUTEX_INITIALIZER,
+                      .cond = PTHREAD_COND_INITIALIZER, .stop = 0 };
+    pthread_t sv_thread;
+    if (autoscale && pthread_create(&sv_thread, NULL, supervise, &sv) != 0) {
+        fprintf(stderr, "paster2: no supervisor, running all workers\n");
+        autoscale = 0;
+    }
 
+    /* the fragments main fetched itself */
+    shm_ring_push_batch(strip_buffer, meta_slot, num_meta);
 
-    U8 * deflated_data=malloc(2000000);
-     U64 deflated_data_length = 0;
-    U8 * inflated_data = malloc(9000000);
-    int offset2 = 0;
-    for (int i = 0; i < 50; i++){
-       
-        memcpy(inflated_data + offset2,  inflated_buffer[i].buf, 9606);
-        offset2 += 9606;
+    /* compress the image while it is pasted together. IHDR gets its
+       final size once every consumer is done. */
+    int ret = 0;
+    U8 signature[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+    U8 iend[4] = { 'I', 'E', 'N', 'D' };
+    FILE * fp = fopen("all.png", "wb+");
+    if (fp == NULL) {
+        perror("fopen");
+        ret = 1;
+    } else if (fwrite(signature, 8, 1, fp) != 1 || write_ihdr(fp, 0, 0) != 0 ||
+               deflate_strips(fp, done_strips, raw, num_strips, strip_raw, raw_size) != 0) {
+        ret = 1;
     }
+    int write_error = ret != 0 && !__atomic_load_n(aborted, __ATOMIC_ACQUIRE);
+    if (write_error) {
+        /* no point pasting an image that cannot be written */
+        __atomic_store_n(aborted, 1, __ATOMIC_RELEASE);
+        shm_ring_close(free_slots);
+        shm_ring_close(done_strips);
+    }
+    if (autoscale) {
+        pthread_mutex_lock(&sv.lock);
+        sv.stop = 1;
+        pthread_cond_signal(&sv.cond);
+        pthread_mutex_unlock(&sv.lock);
+        pthread_join(sv_thread, NULL);
+    }
+    /* wake the parked workers so that they see they are done */
+    pool_resize(&ctl->prod, P);
+    pool_resize(&ctl->cons, C);
 
+    /* every strip is in, or never will be: let the consumers go */
+    shm_ring_close(strip_buffer);
 
-    mem_def(deflated_data, &deflated_data_length, inflated_data, 9606 * 50, Z_DEFAULT_COMPRESSION);
-
-    FILE * fp = fopen("all.png", "wb+");
-    U8 header[8];
-    header[0] = 0x89;
-    header[1] = 0x50;
-    header[2] = 0x4E;
-    header[3] = 0x47;
-    header[4] = 0x0D;
-    header[5] = 0x0A;
-    header[6] = 0x1A;
-    header[7] = 0x0A;
-
-    fwrite(header, 8, 1, fp);
-
-    U8 ihdr_length_type[8];
-    ihdr_length_type[0] = 0x00;
-    ihdr_length_type[1] = 0x00;
-    ihdr_length_type[2] = 0x00;
-    ihdr_length_type[3] = 0x0D;
-    ihdr_length_type[4] = 0x49;
-    ihdr_length_type[5] = 0x48;
-    ihdr_length_type[6] = 0x44;
-    ihdr_length_type[7] = 0x52;
-    fwrite(ihdr_length_type, 8, 1, fp);
-
-    int new_width = htonl(*width);;
-    int new_total_height = htonl(*total_height);;
-
-    fwrite(&new_width, 4, 1, fp);
-    fwrite(&new_total_height, 4, 1, fp);
-
-    U8 data_IHDR_remaining[5];
-    data_IHDR_remaining[0] = 0x08;
-    data_IHDR_remaining[1] = 0x06;
-    data_IHDR_remaining[2] = 0x00;
-    data_IHDR_remaining[3] = 0x00;
-    data_IHDR_remaining[4] = 0x00;
-    fwrite(data_IHDR_remaining, 5, 1, fp);
-
-    //read in ihdr type and data
-    U8 type_data_IHDR[17];
-    fseek(fp, 12, SEEK_SET);
-    fread(type_data_IHDR ,17, 1, fp);
-    U32 calculated_crc_IHDR = (htonl(crc((type_data_IHDR), 17)));
-    fseek(fp, 29, 0);
-    fwrite(&calculated_crc_IHDR, 4, 1, fp);
-
-    //idat
-    
-    unsigned int d = (deflated_data_length);
-    d = htonl(deflated_data_length);
-
-    fseek(fp, 33, 0);
-    fwrite((&d), 4,1,fp);
-    fseek(fp,37,0);
-    U8 idat_type[4];
-    idat_type[0] = 0x49;
-    idat_type[1] = 0x44;
-    idat_type[2] = 0x41;
-    idat_type[3] = 0x54;
-    fwrite(idat_type, 4, 1, fp);
-    
-    fseek(fp, 41, SEEK_SET);
-    fwrite(deflated_data, deflated_data_length, 1, fp);
-    
+    for(int i = 0; i<P;i++){
+        waitpid(prod[i], NULL, 0);
+    }
+      for(int i = 0; i<C;i++){
+        waitpid(cons[i], NULL, 0);
+    }
 
-    //calculate crc
-    U8 type_data_IDAT[4+deflated_data_length];
-    fseek(fp, 37, SEEK_SET);
-    fread(type_data_IDAT ,4+deflated_data_length, 1, fp);
-    U32 calculated_crc_IDAT = (htonl(crc(type_data_IDAT, 4+deflated_data_length)));
-    fseek(fp,41+deflated_data_length , 0);
-    fwrite(&calculated_crc_IDAT, 4, 1, fp);
-
-    //iend
-    U8 iend_length[4];
-    iend_length[0] = 0x00;
-    iend_length[1] = 0x00;
-    iend_length[2] = 0x00;
-    iend_length[3] = 0x00;
-    fwrite(iend_length, 4,1,fp);
-
-    U8 iend_type[4];
-    iend_type[0] = 0x49;
-    iend_type[1] = 0x45;
-    iend_type[2] = 0x4E;
-    iend_type[3] = 0x44;
-    fwrite(iend_type, 4, 1, fp);
-
-
-    unsigned int calculated_crc_IEND = (htonl(crc(iend_type, 4)));
-    fseek(fp,53+deflated_data_length , 0);
-    fwrite(&calculated_crc_IEND, 4, 1, fp);
-
-    free(inflated_data);
-    free(deflated_data);
-    fclose(fp);
+    if (ret == 0 && !*aborted &&
+        *total_height != (num_strips - 1) * strip_height + last_height) {
+        fprintf(stderr, "paster2: pasted %d rows, expected %u\n", *total_height,
+                (num_strips - 1) * strip_height + last_height);
+        ret = 1;
+    }
+    if (ret == 0 && !*aborted) {
+        fseek(fp, 8, SEEK_SET);
+        ret = write_ihdr(fp, *width, *total_height);
+        fseek(fp, 0, SEEK_END);
+        ret |= write_chunk(fp, iend, 0);
+    }
+    if (fp != NULL && fclose(fp) != 0) {
+        ret = 1;
+    }
+    if (ret != 0 || *aborted) {
+        if (write_error || !*aborted) {
+            fprintf(stderr, "paster2: failed to write all.png\n");
+        } else {
+            fprintf(stderr, "paster2: failed to fetch image %d\n", N);
+        }
+        remove("all.png");
+        ret = 1;
+        goto cleanup;
+    }
 
      if (gettimeofday(&tv, NULL) != 0) {
             perror("gettimeofday");
             abort();
         }
         times[1] = (tv.tv_sec) + tv.tv_usec/1000000.;
+        if (verbose) {
+            host_pool_report(hosts, stderr);
+        }
+        if (report_placement) {
+            report_pages("slab", slab, slot_size * num_slots, page);
+            report_pages("raw", raw, raw_size, page);
+        }
         printf("paster2 execution time: %.6lf seconds\n",  times[1] - times[0]);
 
-    sem_destroy(sem_buff);
-    sem_destroy(sem_empty);
-    sem_destroy(sem_filled);
-    sem_destroy(sem_prod_count);
-    sem_destroy(sem_cons_count);
+cleanup:
+
+    host_pool_destroy(hosts);
     
-    shmdt(strip_buffer);
-    shmdt(inflated_buffer);
-    shmdt(total_height);
-    shmdt(width);
-    shmdt(prod_count);
-    shmdt(cons_count);
-    shmdt(sem_buff);
-    shmdt(sem_empty);
-    shmdt(sem_filled);
-    shmdt(sem_prod_count);
-    shmdt(sem_cons_count);
-
-    shmctl(strip_shmid, IPC_RMID, NULL);
-    shmctl(INF_shmid, IPC_RMID, NULL);
-    shmctl(shm_total_height_id, IPC_RMID, NULL);
-    shmctl(shm_width_id, IPC_RMID, NULL);
-    shmctl(shm_prod_cons_id, IPC_RMID, NULL);
-    shmctl(shm_cons_count_id, IPC_RMID, NULL);
-    shmctl(sem_buff_shmid, IPC_RMID, NULL);
-    shmctl(sem_empty_shmid, IPC_RMID, NULL);
-    shmctl(sem_filled_shmid, IPC_RMID, NULL);
-    shmctl(sem_prod_count_shmid, IPC_RMID, NULL);
-    shmctl(sem_cons_count_shmid, IPC_RMID, NULL);
+    shm_arena_destroy(arena);
+    curl_global_cleanup();
 
-    return 0;
+    return ret;
 }
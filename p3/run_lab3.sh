@@ -30,6 +30,8 @@
 #  tb1_N*_$$.txt: average system execution time
 #  tb2_N*_$$.txt: standard deviation of system execution time
 #  where N is the user input $$ is the pid of process that executing this shell script.
+#  Options in PASTER2_OPTS are passed to the executable ahead of B P C X N,
+#  e.g. PASTER2_OPTS="-s localhost:2530" to time against ./mock_server.
 #############################################################################
 PROG="./paster2"
 B="5 10"
@@ -66,7 +68,7 @@ exec_producer ()
     xx=1
     while [ ${xx} -le ${X_TIMES} ]
     do
-        cmd="${PROGRAM} ${BUFFER_SIZE} ${NUM_P} ${NUM_C} ${NUM2SLEEP} ${IMG}"
+        cmd="${PROGRAM} ${PASTER2_OPTS} ${BUFFER_SIZE} ${NUM_P} ${NUM_C} ${NUM2SLEEP} ${IMG}"
         str=`$cmd | tail -1 | awk -F' ' '{print $4}'`
         echo $str  >> ${O_FILE}
         xx=`expr $xx + 1`
@@ -0,0 +1,142 @@
+/**
+ * @file: shm_arena.c
+ * @brief: shared memory arena with a typed layout header
+ */
+
+#define _GNU_SOURCE   /* for memfd_create() */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "shm_arena.h"
+#include "cpu_place.h" /* for place_bind() */
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+/**
+ * @brief start planning a layout with no regions in it
+ */
+void arena_layout_init(ARENA_HEADER *layout)
+{
+    memset(layout, 0, sizeof(ARENA_HEADER));
+    layout->size = round_up(sizeof(ARENA_HEADER), ARENA_LINE);
+}
+
+/**
+ * @brief add a region of size bytes named name to layout. It starts on a
+ *        cache line of its own and no other region shares its last line.
+ * @return the number of the region, for shm_arena_region(); -1 if the
+ *         layout is full
+ */
+int arena_reserve(ARENA_HEADER *layout, const char *name, size_t size)
+{
+    ARENA_REGION *r;
+
+    if (layout->num_regions == ARENA_REGIONS) {
+        return -1;
+    }
+    r = &layout->region[layout->num_regions];
+    strncpy(r->name, name, ARENA_NAME_LEN - 1);
+    r->offset = layout->size;
+    r->size = size;
+    layout->size += round_up(size, ARENA_LINE);
+    return layout->num_regions++;
+}
+
+/**
+ * @brief map a zeroed memfd of the size of layout and copy layout in as
+ *        its header. With huge set the arena is asked for on huge pages;
+ *        if the system has none to give, normal pages are used instead.
+ *        Every region k with bit k of bind set is bound to the NUMA nodes
+ *        in the mask nodes first, since the header write is the first touch
+ *        and its page may hold the start of such a region. If that fails
+ *        the kernel places them, and the header says so with nodes 0.
+ * @return the arena; NULL on failure
+ */
+ARENA_HEADER *shm_arena_create(const ARENA_HEADER *layout, int huge,
+                               unsigned long nodes, unsigned int bind)
+{
+    ARENA_HEADER *arena = MAP_FAILED;
+    size_t size = 0;
+    int fd = -1;
+
+    if (huge) {
+        size = round_up(layout->size, ARENA_HUGE_PAGE);
+        fd = memfd_create("paster2", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd != -1 && ftruncate(fd, size) == 0) {
+            arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (arena == MAP_FAILED) {
+            fprintf(stderr, "shm_arena_create: no huge pages, using normal pages\n");
+            if (fd != -1) {
+                close(fd);
+            }
+            huge = 0;
+        }
+    }
+    if (!huge) {
+        size = round_up(layout->size, sysconf(_SC_PAGESIZE));
+        fd = memfd_create("paster2", MFD_CLOEXEC);
+        if (fd == -1) {
+            perror("memfd_create");
+            return NULL;
+        }
+        if (ftruncate(fd, size) != 0) {
+            perror("ftruncate");
+            close(fd);
+            return NULL;
+        }
+        arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (arena == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);   /* the mapping keeps the memory */
+
+    for (int k = 0; nodes != 0 && k < layout->num_regions; k++) {
+        const ARENA_REGION *r = &layout->region[k];
+
+        if ((bind & (1U << k)) &&
+            place_bind((char *)arena + r->offset, r->size,
+                       huge ? ARENA_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE), nodes) != 0) {
+            perror("shm_arena_create: mbind");
+            nodes = 0;
+        }
+    }
+
+    memcpy(arena, layout, sizeof(ARENA_HEADER));
+    arena->magic = ARENA_MAGIC;
+    arena->version = ARENA_VERSION;
+    arena->size = size;
+    arena->huge = huge;
+    arena->nodes = nodes;
+    return arena;
+}
+
+/**
+ * @return the start of region number region of arena
+ */
+void *shm_arena_region(ARENA_HEADER *arena, int region)
+{
+    return (char *)arena + arena->region[region].offset;
+}
+
+/**
+ * @brief unmap arena from this process. The memory itself goes once every
+ *        process that shares it has unmapped it or exited.
+ */
+void shm_arena_destroy(ARENA_HEADER *arena)
+{
+    if (arena != NULL) {
+        munmap(arena, arena->size);
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ * @file: shm_arena.h
+ * @brief: one block of shared memory that holds everything the processes
+ *         of a run share. It is an anonymous memfd mapped MAP_SHARED before
+ *         fork(), so every child inherits the mapping and the kernel frees
+ *         it once the last process is gone, however that process ends:
+ *         unlike shmget() segments, a crashed run leaves nothing to ipcrm.
+ *
+ * The arena starts with a header that says what lies where: a magic number,
+ * the version of the layout and a table of named regions, each of which
+ * starts on a cache line of its own. The layout is planned first with
+ * arena_reserve() on an ARENA_HEADER on the stack, then the whole arena is
+ * created at once with shm_arena_create(). Regions that are to live on
+ * given NUMA nodes are bound there before anything touches the arena.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* DEFINES */
+#define ARENA_MAGIC     0x32545350  /* "PST2" in memory on little endian */
+#define ARENA_VERSION   2           /* bump when the header changes      */
+#define ARENA_LINE      64          /* regions start on a cache line     */
+#define ARENA_REGIONS   16          /* max number of regions             */
+#define ARENA_NAME_LEN  16          /* max length of a region name       */
+#define ARENA_HUGE_PAGE (2UL << 20) /* huge page size the arena rounds to */
+
+/* TYPEDEFS */
+typedef struct arena_region {
+    char name[ARENA_NAME_LEN];  /* what the region holds, for debugging */
+    size_t offset;              /* from the start of the arena          */
+    size_t size;                /* bytes asked for                      */
+} ARENA_REGION;
+
+typedef struct arena_header {
+    unsigned int magic;         /* ARENA_MAGIC                          */
+    unsigned int version;       /* ARENA_VERSION                        */
+    size_t size;                /* bytes in the arena, header included  */
+    int huge;                   /* non-zero if backed by huge pages     */
+    unsigned long nodes;        /* nodes the bound regions are on, 0 if
+                                   the kernel places them               */
+    int num_regions;
+    ARENA_REGION region[ARENA_REGIONS];
+} ARENA_HEADER;
+
+/* FUNCTION PROTOTYPES */
+void arena_layout_init(ARENA_HEADER *layout);
+int arena_reserve(ARENA_HEADER *layout, const char *name, size_t size);
+ARENA_HEADER *shm_arena_create(const ARENA_HEADER *layout, int huge,
+                               unsigned long nodes, unsigned int bind);
+void *shm_arena_region(ARENA_HEADER *arena, int region);
+void shm_arena_destroy(ARENA_HEADER *arena);
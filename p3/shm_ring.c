@@ -0,0 +1,316 @@
+/**
+ * @file: shm_ring.c
+ * @brief: lock-free bounded MPMC ring in shared memory
+ */
+
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shm_ring.h"
+
+/* Every slot starts with its sequence number, the item follows. A slot at
+   position pos is free for the push of pos while seq == 2 * pos, holds the
+   item of pos while seq == 2 * pos + 1, and is free for the push of
+   pos + size once the pop has set seq to 2 * (pos + size). Counting in
+   steps of two keeps "full" and "free for the next lap" apart even when
+   the ring has a single slot. Positions only grow; the 32 bit sequence
+   numbers wrap, so they are compared by difference. */
+typedef struct ring_slot {
+    unsigned int seq;
+} RING_SLOT;
+
+#define SLOT_HEADER RING_LINE   /* the item starts on its own cache line */
+
+static RING_SLOT *ring_slot(SHM_RING *r, unsigned long pos)
+{
+    return (RING_SLOT *)((char *)r + sizeof(SHM_RING) + (pos % r->size) * r->stride);
+}
+
+static void futex_wait(unsigned int *word, unsigned int val)
+{
+    /* not FUTEX_PRIVATE_FLAG: the waiters are in different processes */
+    syscall(SYS_futex, word, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *word, int n)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/**
+ * @brief bump the futex word and wake n processes asleep on it, but skip
+ *        the system call when nobody is. n is the number of items pushed
+ *        or slots freed: each can only let one waiter through. The fence
+ *        orders the caller's update of the slots before the check of
+ *        waiters, matching ring_wait(), so a process about to sleep either
+ *        sees the update or is seen here.
+ */
+static void ring_signal(unsigned int *word, int *waiters, int n)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+        futex_wake(word, n);
+    }
+}
+
+/**
+ * @brief sleep on word until it is bumped, unless the slot at pos has
+ *        reached seq or the ring has been closed by then
+ */
+static void ring_wait(SHM_RING *r, unsigned int *word, int *waiters,
+                      unsigned long pos, unsigned int seq)
+{
+    unsigned int val = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if ((int)(__atomic_load_n(&ring_slot(r, pos)->seq, __ATOMIC_SEQ_CST) - seq) < 0 &&
+        !__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST)) {
+        futex_wait(word, val);
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @return bytes of shared memory needed by a ring of size items of
+ *         item_size bytes each
+ */
+size_t shm_ring_sizeof(int size, size_t item_size)
+{
+    size_t stride = (SLOT_HEADER + item_size + RING_LINE - 1) / RING_LINE * RING_LINE;
+
+    return sizeof(SHM_RING) + size * stride;
+}
+
+/**
+ * @brief set up an empty ring in memory of shm_ring_sizeof() bytes
+ * @return 0 on success; non-zero otherwise
+ */
+int shm_ring_init(SHM_RING *r, int size, size_t item_size)
+{
+    if (r == NULL || size <= 0) {
+        return 1;
+    }
+    memset(r, 0, sizeof(SHM_RING));
+    r->size = size;
+    r->item_size = item_size;
+    r->stride = (SLOT_HEADER + item_size + RING_LINE - 1) / RING_LINE * RING_LINE;
+    for (int i = 0; i < size; i++) {
+        ring_slot(r, i)->seq = 2 * i;
+    }
+    return 0;
+}
+
+/**
+ * @brief copy item into the ring, waiting while it is full
+ * @return 0 on success; -1 if the ring has been closed
+ */
+int shm_ring_push(SHM_RING *r, const void *item)
+{
+    unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    RING_SLOT *slot;
+
+    while (1) {
+        unsigned int seq;
+        int dif;
+
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        slot = ring_slot(r, pos);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (int)(seq - (unsigned int)(2 * pos));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            /* the pop of pos - size has not happened yet: full */
+            ring_wait(r, &r->not_full, &r->full_waiters, pos, (unsigned int)(2 * pos));
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy((char *)slot + SLOT_HEADER, item, r->item_size);
+    __atomic_store_n(&slot->seq, (unsigned int)(2 * pos + 1), __ATOMIC_RELEASE);
+    ring_signal(&r->not_empty, &r->empty_waiters, 1);
+    return 0;
+}
+
+/**
+ * @brief copy the oldest item out of the ring, waiting while it is empty
+ * @return 0 on success; -1 if the ring has been closed
+ */
+int shm_ring_pop(SHM_RING *r, void *item)
+{
+    unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    RING_SLOT *slot;
+
+    while (1) {
+        unsigned int seq;
+        int dif;
+
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        slot = ring_slot(r, pos);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (int)(seq - (unsigned int)(2 * pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            /* the push of pos has not happened yet: empty */
+            ring_wait(r, &r->not_empty, &r->empty_waiters, pos, (unsigned int)(2 * pos + 1));
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(item, (char *)slot + SLOT_HEADER, r->item_size);
+    __atomic_store_n(&slot->seq, (unsigned int)(2 * (pos + r->size)), __ATOMIC_RELEASE);
+    ring_signal(&r->not_full, &r->full_waiters, 1);
+    return 0;
+}
+
+/**
+ * @return the length, at most max, of the run of slots from pos on that
+ *         are all free for their push (ready 0) or all full (ready 1)
+ */
+static int ring_run(SHM_RING *r, unsigned long pos, int max, unsigned int ready)
+{
+    int k = 0;
+
+    if (max > r->size) {
+        max = r->size;
+    }
+    while (k < max &&
+           __atomic_load_n(&ring_slot(r, pos + k)->seq, __ATOMIC_ACQUIRE) ==
+           (unsigned int)(2 * (pos + k) + ready)) {
+        k++;
+    }
+    return k;
+}
+
+/**
+ * @brief copy the n items at items into the ring in order, waiting while
+ *        it is full. Every run of free slots is claimed with a single
+ *        compare and swap and announced with a single wake-up, however
+ *        many items it takes. Nobody else can touch the slots of the run
+ *        before the swap, since they lie at or past the head it moves.
+ * @return 0 on success; -1 if the ring has been closed, in which case some
+ *         of the items may have been pushed
+ */
+int shm_ring_push_batch(SHM_RING *r, const void *items, int n)
+{
+    const char *p = items;
+
+    while (n > 0) {
+        unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        int k;
+
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        k = ring_run(r, pos, n, 0);
+        if (k == 0) {
+            unsigned int seq = __atomic_load_n(&ring_slot(r, pos)->seq, __ATOMIC_ACQUIRE);
+
+            if ((int)(seq - (unsigned int)(2 * pos)) < 0) {
+                ring_wait(r, &r->not_full, &r->full_waiters, pos, (unsigned int)(2 * pos));
+            }
+            continue;
+        }
+        if (!__atomic_compare_exchange_n(&r->head, &pos, pos + k, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        for (int i = 0; i < k; i++) {
+            RING_SLOT *slot = ring_slot(r, pos + i);
+
+            memcpy((char *)slot + SLOT_HEADER, p, r->item_size);
+            __atomic_store_n(&slot->seq, (unsigned int)(2 * (pos + i) + 1), __ATOMIC_RELEASE);
+            p += r->item_size;
+        }
+        ring_signal(&r->not_empty, &r->empty_waiters, k);
+        n -= k;
+    }
+    return 0;
+}
+
+/**
+ * @brief copy up to max of the oldest items out of the ring into items,
+ *        waiting while it is empty. All the items ready when the ring is
+ *        looked at are taken with one compare and swap, as in
+ *        shm_ring_push_batch().
+ * @return the number of items popped, at least 1; -1 if the ring has been
+ *         closed
+ */
+int shm_ring_pop_batch(SHM_RING *r, void *items, int max)
+{
+    char *p = items;
+
+    while (1) {
+        unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        int k;
+
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        k = ring_run(r, pos, max, 1);
+        if (k == 0) {
+            unsigned int seq = __atomic_load_n(&ring_slot(r, pos)->seq, __ATOMIC_ACQUIRE);
+
+            if ((int)(seq - (unsigned int)(2 * pos + 1)) < 0) {
+                ring_wait(r, &r->not_empty, &r->empty_waiters, pos, (unsigned int)(2 * pos + 1));
+            }
+            continue;
+        }
+        if (!__atomic_compare_exchange_n(&r->tail, &pos, pos + k, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        for (int i = 0; i < k; i++) {
+            RING_SLOT *slot = ring_slot(r, pos + i);
+
+            memcpy(p, (char *)slot + SLOT_HEADER, r->item_size);
+            __atomic_store_n(&slot->seq, (unsigned int)(2 * (pos + i + r->size)), __ATOMIC_RELEASE);
+            p += r->item_size;
+        }
+        ring_signal(&r->not_full, &r->full_waiters, k);
+        return k;
+    }
+}
+
+/**
+ * @return the number of items in the ring, or about that while pushes and
+ *         pops are under way
+ */
+int shm_ring_count(SHM_RING *r)
+{
+    unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    return head > tail ? (int)(head - tail) : 0;
+}
+
+/**
+ * @brief give up on the ring: every push and pop, including those asleep
+ *        now, returns -1 from here on
+ */
+void shm_ring_close(SHM_RING *r)
+{
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&r->not_full, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&r->not_empty, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&r->not_full, INT_MAX);
+    futex_wake(&r->not_empty, INT_MAX);
+}
@@ -0,0 +1,51 @@
+/**
+ * @file: shm_ring.h
+ * @brief: bounded multi-producer multi-consumer FIFO of fixed size items
+ *         that lives in shared memory. Each slot carries a sequence number
+ *         that says whose turn it is, so a push or a pop only has to win a
+ *         compare and swap on its end of the ring; producers and consumers
+ *         never take a common lock (D. Vyukov's bounded MPMC queue).
+ *
+ * Items may also be moved in batches: a run of slots costs one compare and
+ * swap and one wake-up however long it is.
+ *
+ * A process sleeps in the kernel, on a futex, only when the ring is full or
+ * empty, and is only woken by a process that saw it waiting. The structure
+ * holds no pointers so it can be set up before fork() and shared by every
+ * child process.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* DEFINES */
+#define RING_LINE 64    /* cache line size, the ends of the ring are kept
+                           on different lines so they do not share one */
+
+/* TYPEDEFS */
+typedef struct shm_ring {
+    unsigned long head __attribute__((aligned(RING_LINE)));
+                              /* position of the next push */
+    unsigned long tail __attribute__((aligned(RING_LINE)));
+                              /* position of the next pop */
+    unsigned int not_full __attribute__((aligned(RING_LINE)));
+                              /* futex word, bumped when a slot frees up */
+    int full_waiters;         /* producers asleep on not_full */
+    unsigned int not_empty;   /* futex word, bumped when an item lands */
+    int empty_waiters;        /* consumers asleep on not_empty */
+    int closed;               /* set by shm_ring_close() */
+    int size;                 /* number of slots */
+    size_t item_size;         /* bytes in one item */
+    size_t stride;            /* bytes from one slot to the next */
+} SHM_RING;
+
+/* FUNCTION PROTOTYPES */
+size_t shm_ring_sizeof(int size, size_t item_size);
+int shm_ring_init(SHM_RING *r, int size, size_t item_size);
+int shm_ring_push(SHM_RING *r, const void *item);
+int shm_ring_pop(SHM_RING *r, void *item);
+int shm_ring_push_batch(SHM_RING *r, const void *items, int n);
+int shm_ring_pop_batch(SHM_RING *r, void *items, int max);
+int shm_ring_count(SHM_RING *r);
+void shm_ring_close(SHM_RING *r);
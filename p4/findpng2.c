@@ -40,11 +40,14 @@
 #include <libxml/uri.h>
 #include <search.h>
 #include <pthread.h>
+#include "buf_pool.h"  /* for buf_pool_get() */
+#include "host_pool.h" /* for the fetch policy  */
 
 #define SEED_URL "http://ece252-1.uwaterloo.ca/lab4/"
 #define ECE252_HEADER "X-Ece252-Fragment: "
-#define BUF_SIZE 1048576  /* 1024*1024 = 1M */
-#define BUF_INC  524288   /* 1024*512  = 0.5M */
+#define BUF_MIN  16384    /* first allocation when there is no Content-Length */
+#define CONTENT_LENGTH_HEADER "Content-Length: "
+#define FETCH_RETRIES 3      /* retries of a transient failure per URL */
 
 #define CT_PNG  "image/png"
 #define CT_HTML "text/html"
@@ -56,6 +59,8 @@ pthread_mutex_t hashmap_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t cond_var = PTHREAD_COND_INITIALIZER;
 int wait_thread =1;
 int glob_counter = 0;
+BUF_POOL buf_pool;    /* receive buffers reused by every thread */
+HOST_POOL hosts;      /* latency and retry budget of every host met */
 int collection_index = 0;
 struct hsearch_data *visited;
 char *key_collection[1000];
@@ -237,6 +242,7 @@ typedef struct recv_buf2 {
     size_t max_size; /* max capacity of buf in bytes*/
     int seq;         /* >=0 sequence number extracted from http header */
                      /* <0 indicates an invalid seq number */
+    size_t expected; /* Content-Length of the response, 0 if not sent */
 } RECV_BUF;
 
 
@@ -245,7 +251,7 @@ xmlXPathObjectPtr getnodeset (xmlDocPtr doc, xmlChar *xpath);
 int find_http(char *fname, int size, int follow_relative_links, const char *base_url);
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
-int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+int recv_buf_init(RECV_BUF *ptr);
 int recv_buf_cleanup(RECV_BUF *ptr);
 void cleanup(CURL *curl, RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
@@ -383,7 +389,9 @@ int find_http(char *buf, int size, int follow_relative_links, const char *base_u
  * @details this routine will be invoked multiple times by the libcurl until the full
  * header data are received.  we are only interested in the ECE252_HEADER line 
  * received so that we can extract the image sequence number from it. This
- * explains the if block in the code.
+ * explains the if block in the code. The Content-Length line is kept so that
+ * write_cb_curl3 can take a buffer of the right size; a redirect sends one
+ * status line and set of headers per hop, so only the last one counts.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
 {
@@ -399,6 +407,11 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
         /* extract img sequence number */
 	p->seq = atoi(p_recv + strlen(ECE252_HEADER));
 
+    } else if (realsize > 5 && strncmp(p_recv, "HTTP/", 5) == 0) {
+        p->expected = 0;   /* a new response starts */
+    } else if (realsize > strlen(CONTENT_LENGTH_HEADER) &&
+               strncasecmp(p_recv, CONTENT_LENGTH_HEADER, strlen(CONTENT_LENGTH_HEADER)) == 0) {
+        p->expected = strtoul(p_recv + strlen(CONTENT_LENGTH_HEADER), NULL, 10);
     }
     return realsize;
 }
@@ -412,6 +425,9 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
  *        cast it to the proper struct to make good use of it.
  *        This function maybe invoked more than once by one invokation of
  *        curl_easy_perform().
+ *        The first call takes a buffer from buf_pool at the size announced
+ *        by Content-Length; a response without one starts at BUF_MIN and
+ *        doubles as needed.
  */
 
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
@@ -419,16 +435,25 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     size_t realsize = size * nmemb;
     RECV_BUF *p = (RECV_BUF *)p_userdata;
  
-    if (p->size + realsize + 1 > p->max_size) {/* hope this rarely happens */ 
+    if (p->buf == NULL) {
+        /* one extra byte for the terminating 0 */
+        size_t want = p->expected > 0 ? p->expected + 1 : max(BUF_MIN, realsize + 1);
+
+        p->buf = buf_pool_get(&buf_pool, want, &p->max_size);
+        if (p->buf == NULL) {
+            perror("malloc"); /* out of memory */
+            return -1;
+        }
+    }
+
+    if (p->size + realsize + 1 > p->max_size) {/* only without Content-Length */ 
         /* received data is not 0 terminated, add one byte for terminating 0 */
-        size_t new_size = p->max_size + max(BUF_INC, realsize + 1);   
-        char *q = realloc(p->buf, new_size);
+        char *q = buf_grow(p->buf, p->size + realsize + 1, &p->max_size);
         if (q == NULL) {
             perror("realloc"); /* out of memory */
             return -1;
         }
         p->buf = q;
-        p->max_size = new_size;
     }
 
     memcpy(p->buf + p->size, p_recv, realsize); /*copy data from libcurl*/
@@ -439,23 +464,21 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
 }
 
 
-int recv_buf_init(RECV_BUF *ptr, size_t max_size)
+/**
+ * @brief initialize an empty receive buffer. No memory is taken until the
+ *        first data arrives, see write_cb_curl3().
+ */
+int recv_buf_init(RECV_BUF *ptr)
 {
-    void *p = NULL;
-    
     if (ptr == NULL) {
         return 1;
     }
 
-    p = malloc(max_size);
-    if (p == NULL) {
-	return 2;
-    }
-    
-    ptr->buf = p;
+    ptr->buf = NULL;
     ptr->size = 0;
-    ptr->max_size = max_size;
+    ptr->max_size = 0;
     ptr->seq = -1;              /* valid seq should be positive */
+    ptr->expected = 0;
     return 0;
 }
 
@@ -465,7 +488,8 @@ int recv_buf_cleanup(RECV_BUF *ptr)
 	return 1;
     }
     
-    free(ptr->buf);
+    buf_pool_put(&buf_pool, ptr->buf, ptr->max_size);
+    ptr->buf = NULL;
     ptr->size = 0;
     ptr->max_size = 0;
     return 0;
@@ -528,7 +552,7 @@ CURL *easy_handle_init(RECV_BUF *ptr, const char *url)
     }
 
     /* init user defined call back function buffer */
-    if ( recv_buf_init(ptr, BUF_SIZE) != 0 ) {
+    if ( recv_buf_init(ptr) != 0 ) {
         return NULL;
     }
     /* init a curl session */
@@ -564,10 +588,7 @@ CURL *easy_handle_init(RECV_BUF *ptr, const char *url)
     /* supports all built-in encodings */ 
     curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
 
-    /* Max time in seconds that the connection phase to the server to take */
-    //curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, 5L);
-    /* Max time in seconds that libcurl transfer operation is allowed to take */
-    //curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 10L);
+    /* the timeouts depend on the host, see perform_with_retry() */
     /* Time out for Expect: 100-continue response in milliseconds */
     //curl_easy_setopt(curl_handle, CURLOPT_EXPECT_100_TIMEOUT_MS, 0L);
 
@@ -581,6 +602,37 @@ CURL *easy_handle_init(RECV_BUF *ptr, const char *url)
     return curl_handle;
 }
 
+/**
+ * @brief curl_easy_perform() of url under the fetch policy of host_pool.h.
+ *        The request may take as long as host_timeout() allows for its
+ *        host. A transient failure is retried up to FETCH_RETRIES times,
+ *        after host_backoff(), for as long as the host has retry budget.
+ */
+CURLcode perform_with_retry(CURL *curl_handle, RECV_BUF *p_recv_buf, const char *url)
+{
+    CURLcode res;
+
+    for (int attempt = 1; ; attempt++) {
+        int h = host_acquire_url(&hosts, url);
+        double timeout = host_timeout(&hosts, h);
+        double seconds = 0;
+
+        curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, (long)(timeout * 1000) + 1);
+        curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS,
+                         (long)((timeout < CONNECT_TIMEOUT ? timeout : CONNECT_TIMEOUT) * 1000) + 1);
+        res = curl_easy_perform(curl_handle);
+        curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME, &seconds);
+        host_release(&hosts, h, seconds, res == CURLE_OK);
+        if (res == CURLE_OK || !host_transient(res) || attempt > FETCH_RETRIES ||
+            !host_retryable(&hosts, h)) {
+            return res;
+        }
+        p_recv_buf->size = 0;   /* drop whatever the failed try received */
+        p_recv_buf->seq = -1;
+        usleep(host_backoff(attempt) * 1000000);
+    }
+}
+
 int process_html(CURL *curl_handle, RECV_BUF *p_recv_buf)
 {
     char fname[256];
@@ -653,6 +705,10 @@ int process_data(CURL *curl_handle, RECV_BUF *p_recv_buf)
         return 1;
     }
 
+    if ( p_recv_buf->size == 0 ) {
+        return 0;   /* empty body, no buffer was ever taken */
+    }
+
     char *ct = NULL;
     res = curl_easy_getinfo(curl_handle, CURLINFO_CONTENT_TYPE, &ct);
     if ( res == CURLE_OK && ct != NULL ) {
@@ -740,20 +796,19 @@ void *do_work(void * args){
             abort();
         }
         /* get it! */
-        res = curl_easy_perform(curl_handle);
+        res = perform_with_retry(curl_handle, &recv_buf, url);
 
         if( res != CURLE_OK) {
-            
+            /* still fall through to the end-of-crawl check below: if this
+               was the last URL, the other threads must be woken up */
             fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            cleanup(curl_handle, &recv_buf);
-            continue;
         } else {
        // printf("%lu bytes received in memory %p, seq=%d.\n", \ recv_buf.size, recv_buf.buf, recv_buf.seq);
-        }
 
         /* process the download data */
       //  printf("process begin");
         process_data(curl_handle, &recv_buf);
+        }
         //printf("process end");
         //int temp_m  =  __sync_fetch_and_sub(&m,0);
         //printf("frontier  lock mutex\n");
@@ -845,6 +900,8 @@ int main( int argc, char** argv )
 
     strcpy(url, argv[optind]);
 
+    buf_pool_init(&buf_pool);
+    host_pool_init(&hosts, NULL, 80, 0);
     png_URL = create_stack(10000);
     
     init_shm_stack(png_URL, 10000);
@@ -938,6 +995,8 @@ int main( int argc, char** argv )
     pthread_mutex_destroy(&frontier_mutex);
     pthread_mutex_destroy(&png_URL_mutex);
     pthread_cond_destroy(&cond_var);
+    buf_pool_destroy(&buf_pool);
+    host_pool_destroy(&hosts);
 
     xmlCleanupParser();
 
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include <libxml/HTMLparser.h>
@@ -40,11 +41,14 @@
 #include <libxml/uri.h>
 #include <search.h>
 #include <pthread.h>
+#include "buf_pool.h"  /* for buf_pool_get() */
+#include "host_pool.h" /* for the fetch policy  */
 
 #define SEED_URL "http://ece252-1.uwaterloo.ca/lab4/"
 #define ECE252_HEADER "X-Ece252-Fragment: "
-#define BUF_SIZE 1048576  /* 1024*1024 = 1M */
-#define BUF_INC  524288   /* 1024*512  = 0.5M */
+#define BUF_MIN  16384    /* first allocation when there is no Content-Length */
+#define CONTENT_LENGTH_HEADER "Content-Length: "
+#define FETCH_RETRIES 3      /* retries of a transient failure per URL */
 
 #define CT_PNG  "image/png"
 #define CT_HTML "text/html"
@@ -260,6 +264,8 @@ int pop(ISTACK *p, char *p_item)
 
 ISTACK *frontier;
 ISTACK *png_URL;
+BUF_POOL buf_pool;    /* receive buffers reused across transfers */
+HOST_POOL hosts;      /* latency and retry budget of every host met */
 
 typedef struct recv_buf2 {
     char *buf;       /* memory to hold a copy of received data */
@@ -267,15 +273,25 @@ typedef struct recv_buf2 {
     size_t max_size; /* max capacity of buf in bytes*/
     int seq;         /* >=0 sequence number extracted from http header */
                      /* <0 indicates an invalid seq number */
+    int attempts;    /* failed tries of this URL so far */
+    size_t expected; /* Content-Length of the response, 0 if not sent */
+    int host;        /* host of the request, see host_acquire_url() */
+    char url[256];   /* the URL fetched, to send it again */
 } RECV_BUF;
 
+typedef struct retry {
+    CURL *eh;           /* the failed transfer */
+    RECV_BUF *recv_buf; /* its receive buffer */
+    double not_before;  /* now_sec() at which it may be sent again */
+} RETRY;
+
 
 htmlDocPtr mem_getdoc(char *buf, int size, const char *url);
 xmlXPathObjectPtr getnodeset (xmlDocPtr doc, xmlChar *xpath);
 int find_http(char *fname, int size, int follow_relative_links, const char *base_url);
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
-int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+int recv_buf_init(RECV_BUF *ptr);
 int recv_buf_cleanup(RECV_BUF *ptr);
 void cleanup(CURL *curl, RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
@@ -413,7 +429,9 @@ int find_http(char *buf, int size, int follow_relative_links, const char *base_u
  * @details this routine will be invoked multiple times by the libcurl until the full
  * header data are received.  we are only interested in the ECE252_HEADER line 
  * received so that we can extract the image sequence number from it. This
- * explains the if block in the code.
+ * explains the if block in the code. The Content-Length line is kept so that
+ * write_cb_curl3 can take a buffer of the right size; a redirect sends one
+ * status line and set of headers per hop, so only the last one counts.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
 {
@@ -429,6 +447,11 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
         /* extract img sequence number */
 	p->seq = atoi(p_recv + strlen(ECE252_HEADER));
 
+    } else if (realsize > 5 && strncmp(p_recv, "HTTP/", 5) == 0) {
+        p->expected = 0;   /* a new response starts */
+    } else if (realsize > strlen(CONTENT_LENGTH_HEADER) &&
+               strncasecmp(p_recv, CONTENT_LENGTH_HEADER, strlen(CONTENT_LENGTH_HEADER)) == 0) {
+        p->expected = strtoul(p_recv + strlen(CONTENT_LENGTH_HEADER), NULL, 10);
     }
     return realsize;
 }
@@ -442,6 +465,9 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
  *        cast it to the proper struct to make good use of it.
  *        This function maybe invoked more than once by one invokation of
  *        curl_easy_perform().
+ *        The first call takes a buffer from buf_pool at the size announced
+ *        by Content-Length; a response without one starts at BUF_MIN and
+ *        doubles as needed.
  */
 
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
@@ -449,16 +475,25 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     size_t realsize = size * nmemb;
     RECV_BUF *p = (RECV_BUF *)p_userdata;
  
-    if (p->size + realsize + 1 > p->max_size) {/* hope this rarely happens */ 
+    if (p->buf == NULL) {
+        /* one extra byte for the terminating 0 */
+        size_t want = p->expected > 0 ? p->expected + 1 : max(BUF_MIN, realsize + 1);
+
+        p->buf = buf_pool_get(&buf_pool, want, &p->max_size);
+        if (p->buf == NULL) {
+            perror("malloc"); /* out of memory */
+            return -1;
+        }
+    }
+
+    if (p->size + realsize + 1 > p->max_size) {/* only without Content-Length */ 
         /* received data is not 0 terminated, add one byte for terminating 0 */
-        size_t new_size = p->max_size + max(BUF_INC, realsize + 1);   
-        char *q = realloc(p->buf, new_size);
+        char *q = buf_grow(p->buf, p->size + realsize + 1, &p->max_size);
         if (q == NULL) {
             perror("realloc"); /* out of memory */
             return -1;
         }
         p->buf = q;
-        p->max_size = new_size;
     }
 
     memcpy(p->buf + p->size, p_recv, realsize); /*copy data from libcurl*/
@@ -469,23 +504,24 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
 }
 
 
-int recv_buf_init(RECV_BUF *ptr, size_t max_size)
+/**
+ * @brief initialize an empty receive buffer. No memory is taken until the
+ *        first data arrives, see write_cb_curl3().
+ */
+int recv_buf_init(RECV_BUF *ptr)
 {
-    void *p = NULL;
-    
     if (ptr == NULL) {
         return 1;
     }
 
-    p = malloc(max_size);
-    if (p == NULL) {
-	return 2;
-    }
-    
-    ptr->buf = p;
+    ptr->buf = NULL;
     ptr->size = 0;
-    ptr->max_size = max_size;
+    ptr->max_size = 0;
     ptr->seq = -1;              /* valid seq should be positive */
+    ptr->attempts = 0;
+    ptr->expected = 0;
+    ptr->host = -1;
+    ptr->url[0] = '\0';
     return 0;
 }
 
@@ -495,7 +531,8 @@ int recv_buf_cleanup(RECV_BUF *ptr)
 	return 1;
     }
     
-    free(ptr->buf);
+    buf_pool_put(&buf_pool, ptr->buf, ptr->max_size);
+    ptr->buf = NULL;
     ptr->size = 0;
     ptr->max_size = 0;
     return 0;
@@ -558,7 +595,7 @@ CURL *easy_handle_init(RECV_BUF *ptr, const char *url)
     }
 
     /* init user defined call back function buffer */
-    if ( recv_buf_init(ptr, BUF_SIZE) != 0 ) {
+    if ( recv_buf_init(ptr) != 0 ) {
         return NULL;
     }
     /* init a curl session */
@@ -594,10 +631,7 @@ CURL *easy_handle_init(RECV_BUF *ptr, const char *url)
     /* supports all built-in encodings */ 
     curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
 
-    /* Max time in seconds that the connection phase to the server to take */
-    //curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, 5L);
-    /* Max time in seconds that libcurl transfer operation is allowed to take */
-    //curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 10L);
+    /* the timeouts depend on the host, see fetch_start() */
     /* Time out for Expect: 100-continue response in milliseconds */
     //curl_easy_setopt(curl_handle, CURLOPT_EXPECT_100_TIMEOUT_MS, 0L);
 
@@ -611,6 +645,47 @@ CURL *easy_handle_init(RECV_BUF *ptr, const char *url)
     return curl_handle;
 }
 
+/**
+ * @brief the current time in seconds
+ */
+double now_sec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/**
+ * @brief send the request of eh, which fetches recv_buf->url into recv_buf,
+ *        on cm. It may take as long as host_timeout() allows for its host.
+ */
+void fetch_start(CURLM *cm, CURL *eh, RECV_BUF *recv_buf)
+{
+    double timeout;
+
+    recv_buf->host = host_acquire_url(&hosts, recv_buf->url);
+    timeout = host_timeout(&hosts, recv_buf->host);
+    curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, (long)(timeout * 1000) + 1);
+    curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT_MS,
+                     (long)((timeout < CONNECT_TIMEOUT ? timeout : CONNECT_TIMEOUT) * 1000) + 1);
+    curl_multi_add_handle(cm, eh);
+}
+
+/**
+ * @brief take the finished request of eh off cm and report how it went
+ *        to its host
+ */
+void fetch_done(CURLM *cm, CURL *eh, RECV_BUF *recv_buf, CURLcode res)
+{
+    double seconds = 0;
+
+    curl_easy_getinfo(eh, CURLINFO_TOTAL_TIME, &seconds);
+    curl_multi_remove_handle(cm, eh);
+    host_release(&hosts, recv_buf->host, seconds, res == CURLE_OK);
+    recv_buf->host = -1;
+}
+
 int process_html(CURL *curl_handle, RECV_BUF *p_recv_buf)
 {
     printf("html\n");
@@ -684,6 +759,10 @@ int process_data(CURL *curl_handle, RECV_BUF *p_recv_buf)
         return 1;
     }
 
+    if ( p_recv_buf->size == 0 ) {
+        return 0;   /* empty body, no buffer was ever taken */
+    }
+
     char *ct = NULL;
     res = curl_easy_getinfo(curl_handle, CURLINFO_CONTENT_TYPE, &ct);
     if ( res == CURLE_OK && ct != NULL ) {
@@ -765,6 +844,8 @@ int main( int argc, char** argv )
 
 
 
+    buf_pool_init(&buf_pool);
+    host_pool_init(&hosts, NULL, 80, 0);
     png_URL = create_stack(10000);
     
     init_shm_stack(png_URL, 10000);
@@ -804,59 +885,97 @@ int main( int argc, char** argv )
     cm = curl_multi_init();
     
     int threads = t;
+    int in_flight = 0;  /* transfers added to cm */
+    int n_retry = 0;    /* failed transfers waiting out their backoff */
+    RETRY *retry = malloc(threads * sizeof(RETRY));
 
+    printf("t: %i\n", threads);
     while(1){
 
-        printf("t: %i\n", threads);
-        for (int s = 0; s < threads; s++) {
-            char url2[256];
-            if (is_empty(frontier) == 0){
-                pop(frontier,url2);
-                //curl_handle = easy_handle_init(&recv_buf, url);
-                RECV_BUF *recv_buf_curl = malloc(sizeof(RECV_BUF));
-                CURL *eh = easy_handle_init(recv_buf_curl, url2);
-                printf("the url: %s\n", url2);
-                curl_easy_setopt(eh, CURLOPT_PRIVATE, recv_buf_curl);
-                curl_easy_setopt(eh, CURLOPT_HEADER, 0L);
-                curl_easy_setopt(eh, CURLOPT_URL, url2);
-                curl_easy_setopt(eh, CURLOPT_VERBOSE, 0L);
-                curl_multi_add_handle(cm, eh);
-                trash[trash_counter] = recv_buf_curl;
-                trash_counter++;
+        /* a retry goes back on cm once its backoff is over */
+        double now = now_sec();
+        for (int i = 0; i < n_retry; ) {
+            if (retry[i].not_before <= now && glob_counter < m) {
+                fetch_start(cm, retry[i].eh, retry[i].recv_buf);
+                in_flight++;
+                retry[i] = retry[--n_retry];
+            } else {
+                i++;
             }
         }
+        while (in_flight + n_retry < threads && glob_counter < m &&
+               is_empty(frontier) == 0) {
+            char url2[256];
+            pop(frontier,url2);
+            //curl_handle = easy_handle_init(&recv_buf, url);
+            RECV_BUF *recv_buf_curl = malloc(sizeof(RECV_BUF));
+            CURL *eh = easy_handle_init(recv_buf_curl, url2);
+            printf("the url: %s\n", url2);
+            curl_easy_setopt(eh, CURLOPT_PRIVATE, recv_buf_curl);
+            curl_easy_setopt(eh, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(eh, CURLOPT_URL, url2);
+            curl_easy_setopt(eh, CURLOPT_VERBOSE, 0L);
+            strcpy(recv_buf_curl->url, url2);
+            fetch_start(cm, eh, recv_buf_curl);
+            in_flight++;
+            trash[trash_counter] = recv_buf_curl;
+            trash_counter++;
+        }
+        if (in_flight == 0 &&
+            (glob_counter >= m || (n_retry == 0 && is_empty(frontier) != 0))) {
+            printf("break\n");
+            break;
+        }
+
+        /* wake up for the first retry that falls due */
+        long wait_ms = MAX_WAIT_MSECS;
+        for (int i = 0; i < n_retry; i++) {
+            long ms = (long)((retry[i].not_before - now) * 1000) + 1;
+            wait_ms = ms < wait_ms ? (ms > 0 ? ms : 0) : wait_ms;
+        }
+        if (in_flight == 0) {
+            usleep(wait_ms * 1000);   /* only retries are left */
+            continue;
+        }
 
         curl_multi_perform(cm, &still_running);
-       // printf("gggg\n");
-       
-        do {
-            
+        if (still_running > 0) {
             int numfds=0;
-            int res = curl_multi_wait(cm, NULL, 0, MAX_WAIT_MSECS, &numfds);
+            int res = curl_multi_wait(cm, NULL, 0, wait_ms, &numfds);
             if(res != CURLM_OK) {
                 fprintf(stderr, "error: curl_multi_wait() returned %d\n", res);
                 continue;
             }
-            /*
-            if(!numfds) {
-                fprintf(stderr, "error: curl_multi_wait() numfds=%d\n", numfds);
-                return EXIT_FAILURE;
-            }
-            */
             curl_multi_perform(cm, &still_running);
+        }
 
-        } while(still_running);
-       
         while ((msg = curl_multi_info_read(cm, &msgs_left))) {
             if (msg->msg == CURLMSG_DONE) {
                 RECV_BUF *recv_buf;
                 CURL *eh = msg->easy_handle;
 
+                in_flight--;
                 return_code = msg->data.result;
                 if(return_code!=CURLE_OK) {
 
                     fprintf(stderr, "CURL error code: %d\n", msg->data.result);
-                    curl_multi_remove_handle(cm, eh);
+                    curl_easy_getinfo(eh, CURLINFO_PRIVATE, &recv_buf);
+                    int h = recv_buf->host;
+                    fetch_done(cm, eh, recv_buf, return_code);
+                    if (host_transient(return_code) && recv_buf->attempts < FETCH_RETRIES &&
+                        host_retryable(&hosts, h)) {
+                        /* try again once the backoff is over, the
+                           other transfers carry on meanwhile */
+                        retry[n_retry].eh = eh;
+                        retry[n_retry].recv_buf = recv_buf;
+                        retry[n_retry].not_before = now_sec() +
+                            host_backoff(++recv_buf->attempts);
+                        n_retry++;
+                        recv_buf->size = 0;
+                        recv_buf->seq = -1;
+                        continue;
+                    }
+                    recv_buf_cleanup(recv_buf);
                     curl_easy_cleanup(eh);
                     continue;
                 }
@@ -869,9 +988,10 @@ int main( int argc, char** argv )
                 curl_easy_getinfo(eh, CURLINFO_PRIVATE, &recv_buf);
 
                 process_data(eh, recv_buf);
+                recv_buf_cleanup(recv_buf);   /* buffer back to buf_pool */
 
 
-                curl_multi_remove_handle(cm, eh);
+                fetch_done(cm, eh, recv_buf, return_code);
                 curl_easy_cleanup(eh);
 
                 
@@ -880,13 +1000,13 @@ int main( int argc, char** argv )
                 fprintf(stderr, "error: after curl_multi_info_read(), CURLMsg=%d\n", msg->msg);
             }
         }
-       // printf("hello\n");
-        if (glob_counter >= m || is_empty(frontier) != 0){
-            printf("break\n");
-            break;
-        }
        
     }
+    /* retries still waiting when -m was reached */
+    for (int i = 0; i < n_retry; i++) {
+        curl_easy_cleanup(retry[i].eh);
+    }
+    free(retry);
     curl_multi_cleanup(cm);
  
 
@@ -925,6 +1045,8 @@ int main( int argc, char** argv )
     destroy_stack(png_URL);
     hdestroy_r(visited);
     free(e.key);
+    buf_pool_destroy(&buf_pool);
+    host_pool_destroy(&hosts);
   
 
     xmlCleanupParser();